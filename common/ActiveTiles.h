@@ -0,0 +1,203 @@
+#ifndef COMMON_ACTIVETILES_H
+#define COMMON_ACTIVETILES_H
+
+// Active-tile tracking for the 9-point stencil solvers.
+//
+// The grid's interior is cut into tiles, and each tile remembers the largest
+// change it saw in the last step.  A tile only changes if something within
+// one cell of it changed, so a step only needs to recompute the tiles whose
+// own or a neighbouring tile's change was above the threshold: with a
+// threshold of 0 the result is exactly the full sweep's, with epsilon tiles
+// that have settled stop being swept too.  Everything else is skipped, and
+// counts as no change in the step's delta.  (Exactly, bit for bit, whatever
+// --tile-cols is, since every row kernel in Stencil.h gives a point the same
+// value wherever in the row it starts.)
+//
+// Grids are given as row pointers (row 0 and cRows+1 are the halo / fixed
+// boundary, as are columns 0 and cCols+1), like stencil9-mpi's.
+//
+//    planActiveTiles(&tiles);
+//    for (k = 0; k < tiles.cList; ++k)
+//       delta = max(delta, runActiveTile(&tiles, k, pfnRow, aSrc, aDst));
+//    swap aSrc and aDst (or copyBackActiveTiles)
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include "Stencil.h"
+
+typedef struct ActiveTiles {
+
+   // the interior, cRows x cCols, in tiles of cTileRows x cTileCols
+   int64_t cRows;
+   int64_t cCols;
+   int64_t cTileRows;
+   int64_t cTileCols;
+   int64_t cTilesDown;
+   int64_t cTilesAcross;
+
+   // a tile is swept while it or a neighbour changed by more than this
+   double threshold;
+
+   // per tile: the largest change in the last step, and whether src and
+   // dst hold the same values in it (a skipped tile must be, since the
+   // grids trade places every step)
+   double *aChange;
+   bool *afSynced;
+
+   // this step's work, from planActiveTiles: tile t to sweep, or -1-t for a
+   // skipped tile whose dst must catch up with src first
+   int64_t *aList;
+   int64_t cList;
+
+   // tiles swept over the whole run, for reporting
+   int64_t cSwept;
+
+} ActiveTiles;
+
+// Returns 0 on success.  Every tile starts out active.
+static inline int64_t createActiveTiles(int64_t cRows, int64_t cCols, int64_t cTileRows, int64_t cTileCols, double threshold, ActiveTiles *pTiles){
+   int64_t iret = 0;
+
+   memset(pTiles, 0, sizeof(*pTiles));
+   pTiles->cRows = cRows;
+   pTiles->cCols = cCols;
+   pTiles->cTileRows = cTileRows;
+   pTiles->cTileCols = cTileCols;
+   pTiles->cTilesDown = (cRows + cTileRows - 1) / cTileRows;
+   pTiles->cTilesAcross = (cCols + cTileCols - 1) / cTileCols;
+   pTiles->threshold = threshold;
+
+   int64_t cTiles = pTiles->cTilesDown * pTiles->cTilesAcross;
+   pTiles->aChange = malloc(cTiles * sizeof(double));
+   pTiles->afSynced = malloc(cTiles * sizeof(bool));
+   pTiles->aList = malloc(cTiles * sizeof(int64_t));
+
+   if (NULL == pTiles->aChange || NULL == pTiles->afSynced || NULL == pTiles->aList) {
+      printf("Out of memory allocating the active tiles!\n");
+      iret = 1; // out of memory
+   }
+   else {
+      for (int64_t t = 0; t < cTiles; ++t) {
+         pTiles->aChange[t] = INFINITY;
+         pTiles->afSynced[t] = false;
+      }
+   }
+
+   return iret;
+}
+
+static inline void destroyActiveTiles(ActiveTiles *pTiles){
+   free(pTiles->aChange);
+   free(pTiles->afSynced);
+   free(pTiles->aList);
+   pTiles->aChange = NULL;
+   pTiles->afSynced = NULL;
+   pTiles->aList = NULL;
+}
+
+// Count a change at interior cell (i, j) -- or at the halo next to it --
+// that didn't come from sweeping the tile, e.g. a neighbour rank's values
+static inline void raiseTileChange(ActiveTiles *pTiles, int64_t i, int64_t j, double change){
+   i = i < 1 ? 1 : i > pTiles->cRows ? pTiles->cRows : i;
+   j = j < 1 ? 1 : j > pTiles->cCols ? pTiles->cCols : j;
+   int64_t t = (i - 1) / pTiles->cTileRows * pTiles->cTilesAcross + (j - 1) / pTiles->cTileCols;
+   if (pTiles->aChange[t] < change) {
+      pTiles->aChange[t] = change;
+   }
+}
+
+// List this step's work from the last step's changes
+static inline void planActiveTiles(ActiveTiles *pTiles){
+   pTiles->cList = 0;
+
+   for (int64_t r = 0; r < pTiles->cTilesDown; ++r) {
+      for (int64_t c = 0; c < pTiles->cTilesAcross; ++c) {
+         int64_t t = r * pTiles->cTilesAcross + c;
+         bool fActive = false;
+
+         for (int64_t nr = r - 1; nr <= r + 1 && !fActive; ++nr) {
+            for (int64_t nc = c - 1; nc <= c + 1 && !fActive; ++nc) {
+               if (nr >= 0 && nr < pTiles->cTilesDown && nc >= 0 && nc < pTiles->cTilesAcross) {
+                  fActive = pTiles->aChange[nr * pTiles->cTilesAcross + nc] > pTiles->threshold;
+               }
+            }
+         }
+
+         if (fActive) {
+            pTiles->aList[pTiles->cList++] = t;
+            ++pTiles->cSwept;
+         }
+         else if (!pTiles->afSynced[t]) {
+            pTiles->aList[pTiles->cList++] = -1 - t;
+         }
+      }
+   }
+}
+
+// Rows [*pLo, *pHi) and columns [*pColLo, *pColHi) of tile t
+static inline void activeTileBounds(const ActiveTiles *pTiles, int64_t t, int64_t *pLo, int64_t *pHi, int64_t *pColLo, int64_t *pColHi){
+   int64_t r = t / pTiles->cTilesAcross;
+   int64_t c = t % pTiles->cTilesAcross;
+   *pLo = 1 + r * pTiles->cTileRows;
+   *pHi = *pLo + pTiles->cTileRows < pTiles->cRows + 1 ? *pLo + pTiles->cTileRows : pTiles->cRows + 1;
+   *pColLo = 1 + c * pTiles->cTileCols;
+   *pColHi = *pColLo + pTiles->cTileCols < pTiles->cCols + 1 ? *pColLo + pTiles->cTileCols : pTiles->cCols + 1;
+}
+
+// Copy tile t of aSrc into aDst
+static inline void copyActiveTile(const ActiveTiles *pTiles, int64_t t, double *const *aSrc, double *const *aDst){
+   int64_t lo, hi, colLo, colHi;
+   activeTileBounds(pTiles, t, &lo, &hi, &colLo, &colHi);
+   for (int64_t i = lo; i < hi; ++i) {
+      memcpy(&aDst[i][colLo], &aSrc[i][colLo], (colHi - colLo) * sizeof(double));
+   }
+}
+
+// Do entry k of the list: sweep the tile from aSrc into aDst with pfnRow,
+// or bring a skipped tile's aDst up to date.  Returns the tile's largest
+// change.  Entries touch only their own tile, so they can run in parallel.
+static inline double runActiveTile(ActiveTiles *pTiles, int64_t k, PFN_STENCIL9_ROW pfnRow, double *const *aSrc, double *const *aDst){
+   int64_t t = pTiles->aList[k];
+   double delta = 0.0;
+
+   if (t < 0) {
+      t = -1 - t;
+      copyActiveTile(pTiles, t, aSrc, aDst);
+      pTiles->afSynced[t] = true;
+   }
+   else {
+      int64_t lo, hi, colLo, colHi;
+      activeTileBounds(pTiles, t, &lo, &hi, &colLo, &colHi);
+
+      // the row kernels work on elements 1..n, so start them a column early
+      // (and they don't round differently for starting at colLo)
+      for (int64_t i = lo; i < hi; ++i) {
+         double temp = pfnRow(&aSrc[i-1][colLo-1], &aSrc[i][colLo-1], &aSrc[i+1][colLo-1], &aDst[i][colLo-1], colHi - colLo);
+         if (delta < temp) delta = temp;
+      }
+
+      // no change at all leaves dst equal to src
+      pTiles->afSynced[t] = delta == 0.0;
+   }
+
+   pTiles->aChange[t] = delta;
+   return delta;
+}
+
+// For solvers that copy dst back into src instead of swapping them: copy
+// back just the tiles this step swept
+static inline void copyBackActiveTiles(ActiveTiles *pTiles, double *const *aDst, double *const *aSrc){
+   for (int64_t k = 0; k < pTiles->cList; ++k) {
+      int64_t t = pTiles->aList[k];
+      if (t >= 0) {
+         copyActiveTile(pTiles, t, aDst, aSrc);
+         pTiles->afSynced[t] = true;
+      }
+   }
+}
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef COMMON_GRID_H
+#define COMMON_GRID_H
+
+// A cRows x cCols grid of doubles (or, from createGridF, floats) with a
+// one-element halo all round, sized at run time.
+//
+// The storage is one 64-byte aligned block, row 0 being the top halo row.
+// Rows are padded to a whole, odd number of cache lines: a power-of-two
+// row length would map the same column of neighbouring rows to the same
+// cache sets, and the stencil reads three of them (and writes a fourth) at
+// once.  aRows (aRowsF for floats) has a pointer to each of the cRows + 2
+// rows, the form the row kernels and ActiveTiles.h take.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "ParallelFor.h"
+
+#define GRID_ALIGN 64
+#define GRID_HUGE_PAGE (2 * 1024 * 1024)
+
+typedef struct Grid {
+
+   int64_t cRows;
+   int64_t cCols;
+   int64_t stride;      // elements from one row to the next
+   size_t cbItem;       // sizeof(double) or sizeof(float)
+
+   void *pData;
+   double **aRows;      // cRows + 2 rows, or NULL for a float grid
+   float **aRowsF;      // cRows + 2 rows, or NULL for a double grid
+
+   size_t cb;
+
+} Grid;
+
+// elements per row for cCols columns plus the halo
+static inline int64_t gridStride(int64_t cCols, size_t cbItem){
+   int64_t cPerLine = GRID_ALIGN / cbItem;
+   int64_t cLines = (cCols + 2 + cPerLine - 1) / cPerLine;
+   if (cLines % 2 == 0) {
+      ++cLines;
+   }
+   return cLines * cPerLine;
+}
+
+// Row i, whichever the element type
+static inline void *gridRow(const Grid *pGrid, int64_t i){
+   return (char*)pGrid->pData + i * pGrid->stride * pGrid->cbItem;
+}
+
+// rows [lo, hi) of a new grid, all of it, zeroed by the thread that will
+// sweep them: the first touch places the pages
+static inline void clearGridRows(Grid *pGrid, int64_t lo, int64_t hi){
+   memset(gridRow(pGrid, lo), 0, (hi - lo) * pGrid->stride * pGrid->cbItem);
+}
+
+DEFINE_PARALLEL_FOR(parallelClear, Grid, clearGridRows)
+
+static inline void destroyGrid(Grid *pGrid){
+   free(pGrid->pData);
+   free(pGrid->aRows);
+   free(pGrid->aRowsF);
+   pGrid->pData = NULL;
+   pGrid->aRows = NULL;
+   pGrid->aRowsF = NULL;
+}
+
+// Allocate, but don't touch, the grid's storage: whoever writes a page
+// first decides which node it lives on, so let the threads that will work
+// on the rows clear them (parallelClear).  fHugePages asks for transparent
+// huge pages, which cut the TLB misses of walking down the columns of a
+// big grid.
+// Returns 0 on success.
+static inline int64_t createGridOf(int64_t cRows, int64_t cCols, size_t cbItem, bool fHugePages, Grid *pGrid){
+   int64_t iret = 0;
+
+   pGrid->cRows = cRows;
+   pGrid->cCols = cCols;
+   pGrid->cbItem = cbItem;
+   pGrid->stride = gridStride(cCols, cbItem);
+   pGrid->cb = (size_t)(cRows + 2) * pGrid->stride * cbItem;
+   pGrid->pData = NULL;
+   pGrid->aRows = NULL;
+   pGrid->aRowsF = NULL;
+
+   size_t align = GRID_ALIGN;
+   if (fHugePages) {
+      align = GRID_HUGE_PAGE;
+      pGrid->cb = (pGrid->cb + GRID_HUGE_PAGE - 1) / GRID_HUGE_PAGE * GRID_HUGE_PAGE;
+   }
+
+   if (0 != posix_memalign(&pGrid->pData, align, pGrid->cb)) {
+      pGrid->pData = NULL;
+      iret = 1; // out of memory
+   }
+
+   if (0 == iret) {
+      if (cbItem == sizeof(float)) {
+         pGrid->aRowsF = malloc((cRows + 2) * sizeof(float*));
+      }
+      else {
+         pGrid->aRows = malloc((cRows + 2) * sizeof(double*));
+      }
+      if (NULL == pGrid->aRows && NULL == pGrid->aRowsF) {
+         iret = 1; // out of memory
+      }
+   }
+
+   if (0 == iret) {
+      for (int64_t i = 0; i < cRows + 2; ++i) {
+         if (NULL != pGrid->aRowsF) {
+            pGrid->aRowsF[i] = gridRow(pGrid, i);
+         }
+         else {
+            pGrid->aRows[i] = gridRow(pGrid, i);
+         }
+      }
+
+#ifdef MADV_HUGEPAGE
+      // only a hint: without THP the grid just gets small pages
+      if (fHugePages) {
+         madvise(pGrid->pData, pGrid->cb, MADV_HUGEPAGE);
+      }
+#endif
+   }
+   else {
+      printf("Out of memory allocating a %lld x %lld grid!\n", (long long)cRows, (long long)cCols);
+      destroyGrid(pGrid);
+   }
+
+   return iret;
+}
+
+static inline int64_t createGrid(int64_t cRows, int64_t cCols, bool fHugePages, Grid *pGrid){
+   return createGridOf(cRows, cCols, sizeof(double), fHugePages, pGrid);
+}
+
+static inline int64_t createGridF(int64_t cRows, int64_t cCols, bool fHugePages, Grid *pGrid){
+   return createGridOf(cRows, cCols, sizeof(float), fHugePages, pGrid);
+}
+
+#endif
@@ -0,0 +1,326 @@
+#ifndef COMMON_MULTIGRID_H
+#define COMMON_MULTIGRID_H
+
+// Geometric multigrid for the 9-point relaxation.
+//
+// Repeatedly applying the stencil S solves (I - S) x = 0, and the change a
+// sweep makes, S x - x, is that equation's residual.  A sweep only damps
+// the error quickly where it varies from cell to cell; smooth error takes
+// O(n^2) sweeps to go away.  Multigrid moves the smooth part to a grid with
+// half the cells in each direction, where it is rough again, and recurses:
+//
+//    smooth:    e <- S e + b          (cSmooth sweeps, the usual row kernel)
+//    restrict:  b' = 4 R (b + S e - e) full weighting; I - S scales as h^2
+//    recurse:   solve (I - S) e' = b' from e' = 0, cCycle times (V or W)
+//    prolong:   e <- e + P e'         bilinear
+//    smooth:    cSmooth sweeps
+//
+// Coarse point (I, J) sits on fine point (2I, 2J).  The far boundary only
+// lines up with a coarse point when the fine level has an odd number of
+// cells; otherwise it falls between the last coarse point and the halo.  So
+// each level keeps where its far boundary is, beta rows (columns) past its
+// last row (column), and the coarse level gets the n / 2 or n / 2 - 1
+// points below n that leave its beta in [1/2, 3/2).  Before a level's e (or
+// residual) is read, its far halo is refilled by linear extrapolation
+// through zero at the boundary, (beta - 1) / beta times the last row
+// (column): nothing when beta is 1, O(n) against an O(n^2) sweep when not.
+// Sizes that aren't 2^k - 1 then converge as fast as those that are.  The
+// finest level has b = 0 and runs on the caller's two grids; the
+// convergence test is the same max |S x - x| the plain iteration stops on.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include "Grid.h"
+#include "ParallelFor.h"
+#include "Stencil.h"
+
+// sweeps on the coarsest level, which is at most 2 cells across
+#define MG_COARSEST_SWEEPS 16
+
+// V- or W-cycles: how often each level recurses
+typedef enum MG_CYCLE {
+   MG_V = 1,
+   MG_W = 2
+} MG_CYCLE;
+
+typedef struct MgLevel {
+
+   int64_t cRows;
+   int64_t cCols;
+
+   // the level's solution, its sweep partner (also where the residual
+   // goes), and its right-hand side (NULL on the finest level: 0)
+   double **e;
+   double **tmp;
+   double **b;
+
+   // the coarse levels' storage for the above
+   Grid aGrids[3];
+
+   // the far boundary's distance past the last row and column (1 when it
+   // is the halo, as on the finest level)
+   double rowBoundary;
+   double colBoundary;
+
+} MgLevel;
+
+typedef struct Multigrid {
+
+   ParallelPool *pPool;
+   PFN_STENCIL9_ROW pfnRow;
+
+   MgLevel *aLevels;
+   int64_t cLevels;
+
+   int64_t cSmooth;     // sweeps before and after each coarse correction
+   MG_CYCLE cycle;
+
+   int64_t cFineSweeps; // sweeps over the finest grid, for reporting
+
+} Multigrid;
+
+// What the row kernels below work on
+typedef struct MgStep {
+   MgLevel *pFine;
+   MgLevel *pCoarse;
+   PFN_STENCIL9_ROW pfnRow;
+} MgStep;
+
+// Refill the far halo of one of the level's grids, the column first so the
+// corner is extrapolated both ways
+static inline void mgExtrapolate(MgLevel *pLevel, double **x){
+   int64_t m = pLevel->cRows;
+   int64_t n = pLevel->cCols;
+   if (pLevel->colBoundary != 1.0) {
+      double scale = (pLevel->colBoundary - 1.0) / pLevel->colBoundary;
+      for (int64_t i = 1; i <= m; ++i) {
+         x[i][n+1] = scale * x[i][n];
+      }
+   }
+   if (pLevel->rowBoundary != 1.0) {
+      double scale = (pLevel->rowBoundary - 1.0) / pLevel->rowBoundary;
+      for (int64_t j = 0; j <= n + 1; ++j) {
+         x[m+1][j] = scale * x[m][j];
+      }
+   }
+}
+
+// The points, and the far boundary past them, below a level of n points
+// with its boundary beta past the last: the n / 2 or n / 2 - 1 points that
+// leave the coarse beta in [1/2, 3/2)
+static inline int64_t mgCoarsen(int64_t n, double beta, double *pBeta){
+   int64_t m = (int64_t)floor((n + beta - 1.0) / 2.0);
+   *pBeta = (n + beta) / 2.0 - m;
+   return m;
+}
+
+// rows [lo, hi): tmp = S e + b, returning the largest |S e - e|
+static inline double mgSmoothRows(MgStep *pStep, int64_t lo, int64_t hi){
+   MgLevel *pLevel = pStep->pFine;
+   double delta = 0.0;
+   for (int64_t i = lo; i < hi; ++i) {
+      double temp = pStep->pfnRow(pLevel->e[i-1], pLevel->e[i], pLevel->e[i+1], pLevel->tmp[i], pLevel->cCols);
+      if (delta < temp) delta = temp;
+      if (NULL != pLevel->b) {
+         for (int64_t j = 1; j <= pLevel->cCols; ++j) {
+            pLevel->tmp[i][j] += pLevel->b[i][j];
+         }
+      }
+   }
+   return delta;
+}
+
+DEFINE_PARALLEL_REDUCE(mgSmooth, MgStep, 0.0, mgSmoothRows, parallelMax)
+
+// rows [lo, hi): tmp = b + S e - e, returning its largest magnitude
+static inline double mgResidualRows(MgStep *pStep, int64_t lo, int64_t hi){
+   MgLevel *pLevel = pStep->pFine;
+   double delta = 0.0;
+   for (int64_t i = lo; i < hi; ++i) {
+      double *r = pLevel->tmp[i];
+      pStep->pfnRow(pLevel->e[i-1], pLevel->e[i], pLevel->e[i+1], r, pLevel->cCols);
+      for (int64_t j = 1; j <= pLevel->cCols; ++j) {
+         r[j] -= pLevel->e[i][j];
+         if (NULL != pLevel->b) {
+            r[j] += pLevel->b[i][j];
+         }
+         double temp = fabs(r[j]);
+         if (delta < temp) delta = temp;
+      }
+   }
+   return delta;
+}
+
+DEFINE_PARALLEL_REDUCE(mgResidual, MgStep, 0.0, mgResidualRows, parallelMax)
+
+// coarse rows [lo, hi): b' = 4 R r from the fine residual, and e' = 0
+static inline void mgRestrictRows(MgStep *pStep, int64_t lo, int64_t hi){
+   double **r = pStep->pFine->tmp;
+   MgLevel *pCoarse = pStep->pCoarse;
+   for (int64_t I = lo; I < hi; ++I) {
+      int64_t i = 2 * I;
+      memset(&pCoarse->e[I][1], 0, pCoarse->cCols * sizeof(double));
+      for (int64_t J = 1; J <= pCoarse->cCols; ++J) {
+         int64_t j = 2 * J;
+         double center = r[i][j];
+         double adjacent = r[i-1][j] + r[i+1][j] + r[i][j-1] + r[i][j+1];
+         double diagonals = r[i-1][j-1] + r[i-1][j+1] + r[i+1][j-1] + r[i+1][j+1];
+         pCoarse->b[I][J] = (4.0 * center + 2.0 * adjacent + diagonals) * 0.25;
+      }
+   }
+}
+
+DEFINE_PARALLEL_FOR(mgRestrict, MgStep, mgRestrictRows)
+
+// fine rows [lo, hi): e += P e'.  Fine point i lies between coarse points
+// i/2 and (i+1)/2, which are the same point when i is even; the last fine
+// points may lie between the last coarse point and its extrapolated halo.
+static inline void mgProlongRows(MgStep *pStep, int64_t lo, int64_t hi){
+   MgLevel *pFine = pStep->pFine;
+   double **c = pStep->pCoarse->e;
+   for (int64_t i = lo; i < hi; ++i) {
+      double *c0 = c[i / 2];
+      double *c1 = c[(i + 1) / 2];
+      for (int64_t j = 1; j <= pFine->cCols; ++j) {
+         int64_t j0 = j / 2;
+         int64_t j1 = (j + 1) / 2;
+         pFine->e[i][j] += 0.25 * (c0[j0] + c0[j1] + c1[j0] + c1[j1]);
+      }
+   }
+}
+
+DEFINE_PARALLEL_FOR(mgProlong, MgStep, mgProlongRows)
+
+static inline void destroyMultigrid(Multigrid *pMg){
+   for (int64_t l = 1; l < pMg->cLevels; ++l) {
+      for (int g = 0; g < 3; ++g) {
+         destroyGrid(&pMg->aLevels[l].aGrids[g]);
+      }
+   }
+   free(pMg->aLevels);
+   pMg->aLevels = NULL;
+   pMg->cLevels = 0;
+}
+
+// Levels below a cRows x cCols grid whose solution is in e, with tmp (same
+// shape, zero halo) as its partner.  Returns 0 on success.
+static inline int64_t createMultigrid(ParallelPool *pPool, PFN_STENCIL9_ROW pfnRow, int64_t cRows, int64_t cCols, double **e, double **tmp, int64_t cSmooth, MG_CYCLE cycle, bool fHugePages, Multigrid *pMg){
+   int64_t iret = 0;
+
+   memset(pMg, 0, sizeof(*pMg));
+   pMg->pPool = pPool;
+   pMg->pfnRow = pfnRow;
+   pMg->cSmooth = cSmooth;
+   pMg->cycle = cycle;
+
+   // halve until a level has no coarse points left below it
+   int64_t cLevels = 1;
+   double rowBoundary = 1.0;
+   double colBoundary = 1.0;
+   for (int64_t r = cRows, c = cCols; ; ++cLevels) {
+      r = mgCoarsen(r, rowBoundary, &rowBoundary);
+      c = mgCoarsen(c, colBoundary, &colBoundary);
+      if (r < 1 || c < 1) {
+         break;
+      }
+   }
+
+   pMg->aLevels = calloc(cLevels, sizeof(MgLevel));
+   if (NULL == pMg->aLevels) {
+      printf("Out of memory allocating the multigrid levels!\n");
+      return 1; // out of memory
+   }
+   pMg->cLevels = cLevels;
+
+   pMg->aLevels[0].cRows = cRows;
+   pMg->aLevels[0].cCols = cCols;
+   pMg->aLevels[0].e = e;
+   pMg->aLevels[0].tmp = tmp;
+   pMg->aLevels[0].b = NULL;
+   pMg->aLevels[0].rowBoundary = 1.0;
+   pMg->aLevels[0].colBoundary = 1.0;
+
+   for (int64_t l = 1; 0 == iret && l < cLevels; ++l) {
+      MgLevel *pLevel = &pMg->aLevels[l];
+      MgLevel *pFine = &pMg->aLevels[l-1];
+      pLevel->cRows = mgCoarsen(pFine->cRows, pFine->rowBoundary, &pLevel->rowBoundary);
+      pLevel->cCols = mgCoarsen(pFine->cCols, pFine->colBoundary, &pLevel->colBoundary);
+
+      for (int g = 0; 0 == iret && g < 3; ++g) {
+         iret = createGrid(pLevel->cRows, pLevel->cCols, fHugePages, &pLevel->aGrids[g]);
+         if (0 == iret) {
+            parallelClear(pPool, 0, pLevel->cRows + 2, &pLevel->aGrids[g]);
+         }
+      }
+
+      pLevel->e = pLevel->aGrids[0].aRows;
+      pLevel->tmp = pLevel->aGrids[1].aRows;
+      pLevel->b = pLevel->aGrids[2].aRows;
+   }
+
+   if (0 != iret) {
+      destroyMultigrid(pMg);
+   }
+
+   return iret;
+}
+
+// cSweeps sweeps of level l, returning the last one's largest |S e - e|
+static inline double mgSweeps(Multigrid *pMg, int64_t l, int64_t cSweeps){
+   MgLevel *pLevel = &pMg->aLevels[l];
+   MgStep step = { pLevel, NULL, pMg->pfnRow };
+   double delta = 0.0;
+
+   for (int64_t s = 0; s < cSweeps; ++s) {
+      mgExtrapolate(pLevel, pLevel->e);
+      delta = mgSmooth(pMg->pPool, 1, pLevel->cRows + 1, &step);
+
+      double **temp = pLevel->e;
+      pLevel->e = pLevel->tmp;
+      pLevel->tmp = temp;
+   }
+
+   if (0 == l) {
+      pMg->cFineSweeps += cSweeps;
+   }
+   return delta;
+}
+
+static inline void mgCycle(Multigrid *pMg, int64_t l){
+   if (l == pMg->cLevels - 1) {
+      mgSweeps(pMg, l, MG_COARSEST_SWEEPS);
+      return;
+   }
+
+   MgStep step = { &pMg->aLevels[l], &pMg->aLevels[l+1], pMg->pfnRow };
+
+   mgSweeps(pMg, l, pMg->cSmooth);
+
+   mgExtrapolate(step.pFine, step.pFine->e);
+   mgResidual(pMg->pPool, 1, step.pFine->cRows + 1, &step);
+   mgExtrapolate(step.pFine, step.pFine->tmp);
+   mgRestrict(pMg->pPool, 1, step.pCoarse->cRows + 1, &step);
+
+   for (int64_t c = 0; c < (int64_t)pMg->cycle; ++c) {
+      mgCycle(pMg, l + 1);
+   }
+
+   mgExtrapolate(step.pCoarse, step.pCoarse->e);
+   mgProlong(pMg->pPool, 1, step.pFine->cRows + 1, &step);
+
+   mgSweeps(pMg, l, pMg->cSmooth);
+}
+
+// One V- or W-cycle from the finest level.  Returns max |S x - x| of the
+// result, which is in pMg->aLevels[0].e.
+static inline double multigridCycle(Multigrid *pMg){
+   MgStep step = { &pMg->aLevels[0], NULL, pMg->pfnRow };
+   mgCycle(pMg, 0);
+   return mgResidual(pMg->pPool, 1, pMg->aLevels[0].cRows + 1, &step);
+}
+
+#endif
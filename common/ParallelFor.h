@@ -0,0 +1,250 @@
+#ifndef COMMON_PARALLELFOR_H
+#define COMMON_PARALLELFOR_H
+
+// parallel_for / parallel_reduce over a ThreadPool.
+//
+// A loop body is a range kernel, kernel(pContext, lo, hi), written as a
+// static inline function next to the loop.  DEFINE_PARALLEL_FOR and
+// DEFINE_PARALLEL_REDUCE stamp out a pool worker for each kernel, so the
+// kernel is inlined into the worker's range loop instead of being called
+// through a function pointer per range.
+//
+//    static inline void scaleRows(Grid *pGrid, int64_t lo, int64_t hi){ ... }
+//    DEFINE_PARALLEL_FOR(parallelScale, Grid, scaleRows)
+//    ...
+//    parallelScale(&pool, 0, cRows, &grid);
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "ThreadPool.h"
+#include "Partition.h"
+
+// How a loop's iterations are dealt out to the workers
+typedef enum PARTITION {
+   PARTITION_BLOCK,        // computeMyBlockPart
+   PARTITION_CYCLIC,       // computeMyCyclicPart, one iteration at a time
+   PARTITION_BLOCK_CYCLIC, // computeMyBlockCyclicPart with blocks of chunk
+   PARTITION_WEIGHTED,     // computeMyWeightedPart over the loop's cost prefix
+   PARTITION_DYNAMIC,      // chunks claimed from a shared counter
+   PARTITION_COUNT
+} PARTITION;
+
+// The loop currently running on a ParallelPool
+typedef struct ParallelLoop {
+
+   // iterations [lo, hi)
+   int64_t lo;
+   int64_t hi;
+
+   PARTITION partition;
+
+   // block-cyclic & dynamic: iterations per chunk
+   int64_t chunk;
+
+   // weighted: computeCostPrefix of the cost of iterations [lo, hi)
+   const double *aPrefix;
+
+   // handed to the kernel
+   void *pContext;
+
+   // dynamic: first iteration nobody has claimed yet
+   _Atomic int64_t next __attribute__((aligned(64)));
+
+} ParallelLoop;
+
+// One worker's view of the loop.  Padded to a cache line so the partial
+// results of a reduction don't share lines.
+typedef struct ParallelWorker {
+
+   ParallelLoop *pLoop;
+   int64_t myTaskId;
+   int64_t numTasks;
+
+   // parallel_reduce: this worker's partial result
+   double result;
+
+} __attribute__((aligned(64))) ParallelWorker;
+
+// A thread pool plus the loop it runs.  Holds pointers into itself, so it
+// must not be moved once created.
+typedef struct ParallelPool {
+
+   ThreadPool pool;
+   ParallelWorker *aWorkers;
+   ParallelLoop loop;
+
+} ParallelPool;
+
+// Start cThreads workers; loops use the block partition until
+// setParallelPartition says otherwise.  Returns 0 on success.
+static inline int64_t createParallelPool(int64_t cThreads, ParallelPool *pPool){
+   int64_t iret = 0;
+
+   if (0 != posix_memalign((void**)&pPool->aWorkers, 64, cThreads * sizeof(ParallelWorker))) {
+      printf("Out of memory allocating the parallel workers!\n");
+      pPool->aWorkers = NULL;
+      iret = 1; // out of memory
+   }
+
+   if (0 == iret) {
+      for (int64_t i = 0; i < cThreads; ++i) {
+         pPool->aWorkers[i].pLoop = &pPool->loop;
+         pPool->aWorkers[i].myTaskId = i;
+         pPool->aWorkers[i].numTasks = cThreads;
+         pPool->aWorkers[i].result = 0.0;
+      }
+
+      pPool->loop.partition = PARTITION_BLOCK;
+      pPool->loop.chunk = 1;
+      pPool->loop.aPrefix = NULL;
+      atomic_init(&pPool->loop.next, 0);
+
+      iret = createThreadPool(cThreads, &pPool->pool);
+      if (0 != iret) {
+         free(pPool->aWorkers);
+         pPool->aWorkers = NULL;
+      }
+   }
+
+   return iret;
+}
+
+static inline int64_t destroyParallelPool(ParallelPool *pPool){
+   int64_t iret = destroyThreadPool(&pPool->pool);
+   free(pPool->aWorkers);
+   pPool->aWorkers = NULL;
+   return iret;
+}
+
+// How the following loops are partitioned.  chunk is for block-cyclic and
+// dynamic, aPrefix (lo..hi of every following loop) for weighted.
+static inline void setParallelPartition(ParallelPool *pPool, PARTITION partition, int64_t chunk, const double *aPrefix){
+   pPool->loop.partition = partition;
+   pPool->loop.chunk = chunk > 0 ? chunk : 1;
+   pPool->loop.aPrefix = aPrefix;
+}
+
+// The task id (0..cThreads-1) of the worker running the calling kernel,
+// for kernels that keep per-worker scratch space in their context
+static __thread int64_t t_parallelTaskId;
+
+static inline int64_t currentParallelTask(){
+   return t_parallelTaskId;
+}
+
+// Hand a worker its next range [*pLo, *pHi) of the loop.  Start with
+// *pCursor = 0.  Returns false once the worker has nothing left.
+static inline bool nextParallelRange(ParallelWorker *pWorker, int64_t *pCursor, int64_t *pLo, int64_t *pHi){
+   ParallelLoop *pLoop = pWorker->pLoop;
+   int64_t numItems = pLoop->hi - pLoop->lo;
+   int64_t lo = 0;
+   int64_t hi = 0;
+
+   switch (pLoop->partition) {
+   case PARTITION_BLOCK:
+      if (*pCursor > 0) {
+         return false;
+      }
+      computeMyBlockPart(numItems, pWorker->numTasks, pWorker->myTaskId, &lo, &hi);
+      break;
+
+   case PARTITION_WEIGHTED:
+      if (*pCursor > 0) {
+         return false;
+      }
+      computeMyWeightedPart(pLoop->aPrefix, numItems, pWorker->numTasks, pWorker->myTaskId, &lo, &hi);
+      break;
+
+   case PARTITION_DYNAMIC:
+      lo = atomic_fetch_add(&pLoop->next, pLoop->chunk);
+      hi = lo + pLoop->chunk < numItems ? lo + pLoop->chunk : numItems;
+      break;
+
+   default: {
+      // cyclic is block-cyclic with blocks of one iteration
+      int64_t blockSize = pLoop->partition == PARTITION_CYCLIC ? 1 : pLoop->chunk;
+      int64_t first = 0;
+      int64_t stride = 0;
+      computeMyBlockCyclicPart(numItems, pWorker->numTasks, pWorker->myTaskId, blockSize, &first, &hi, &stride);
+      lo = first + *pCursor * stride;
+      hi = lo + blockSize < hi ? lo + blockSize : hi;
+      break;
+   }
+   }
+
+   ++*pCursor;
+   *pLo = pLoop->lo + lo;
+   *pHi = pLoop->lo + hi;
+   return lo < hi;
+}
+
+// Run pfnWorker, a worker from DEFINE_PARALLEL_FOR / _REDUCE, over [lo, hi)
+static inline int64_t runParallelLoop(ParallelPool *pPool, void *(*pfnWorker)(void *), int64_t lo, int64_t hi, void *pContext){
+   pPool->loop.lo = lo;
+   pPool->loop.hi = hi;
+   pPool->loop.pContext = pContext;
+   atomic_store(&pPool->loop.next, 0);
+
+   return runThreadPool(&pPool->pool, pfnWorker, pPool->aWorkers, sizeof(ParallelWorker));
+}
+
+// Combiners for DEFINE_PARALLEL_REDUCE
+static inline double parallelMax(double a, double b){
+   return a > b ? a : b;
+}
+
+static inline double parallelSum(double a, double b){
+   return a + b;
+}
+
+// Define int64_t name(ParallelPool *pPool, int64_t lo, int64_t hi,
+// CONTEXT *pContext), running kernel(pContext, rangeLo, rangeHi) over
+// every range of [lo, hi).
+#define DEFINE_PARALLEL_FOR(name, CONTEXT, kernel)                            \
+   static void *name##Worker(void *ptr){                                      \
+      ParallelWorker *pWorker = (ParallelWorker*)ptr;                         \
+      CONTEXT *pContext = (CONTEXT*)pWorker->pLoop->pContext;                 \
+      t_parallelTaskId = pWorker->myTaskId;                                   \
+      int64_t cursor = 0;                                                     \
+      int64_t lo;                                                             \
+      int64_t hi;                                                             \
+      while (nextParallelRange(pWorker, &cursor, &lo, &hi)) {                 \
+         kernel(pContext, lo, hi);                                            \
+      }                                                                       \
+      return NULL;                                                            \
+   }                                                                          \
+   static inline int64_t name(ParallelPool *pPool, int64_t lo, int64_t hi, CONTEXT *pContext){ \
+      return runParallelLoop(pPool, name##Worker, lo, hi, (void*)pContext);   \
+   }
+
+// Define double name(ParallelPool *pPool, int64_t lo, int64_t hi,
+// CONTEXT *pContext), folding the doubles kernel(pContext, rangeLo, rangeHi)
+// returns for every range of [lo, hi) with combine, starting at identity.
+#define DEFINE_PARALLEL_REDUCE(name, CONTEXT, identity, kernel, combine)      \
+   static void *name##Worker(void *ptr){                                      \
+      ParallelWorker *pWorker = (ParallelWorker*)ptr;                         \
+      CONTEXT *pContext = (CONTEXT*)pWorker->pLoop->pContext;                 \
+      t_parallelTaskId = pWorker->myTaskId;                                   \
+      double result = (identity);                                             \
+      int64_t cursor = 0;                                                     \
+      int64_t lo;                                                             \
+      int64_t hi;                                                             \
+      while (nextParallelRange(pWorker, &cursor, &lo, &hi)) {                 \
+         result = combine(result, kernel(pContext, lo, hi));                  \
+      }                                                                       \
+      pWorker->result = result;                                               \
+      return NULL;                                                            \
+   }                                                                          \
+   static inline double name(ParallelPool *pPool, int64_t lo, int64_t hi, CONTEXT *pContext){ \
+      double result = (identity);                                             \
+      runParallelLoop(pPool, name##Worker, lo, hi, (void*)pContext);          \
+      for (int64_t t = 0; t < pPool->pool.cThreads; ++t) {                    \
+         result = combine(result, pPool->aWorkers[t].result);                 \
+      }                                                                       \
+      return result;                                                          \
+   }
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef COMMON_PARTITION_H
+#define COMMON_PARTITION_H
+
+// Ways of dividing numItems items [0, numItems) among numTasks tasks.
+// Every program here partitions through these, so a better partition
+// helps all of them.
+
+#include <stdint.h>
+
+// One contiguous block per task; the first numItems % numTasks tasks get
+// one extra item.
+static inline void computeMyBlockPart(
+   int64_t numItems, // # items to distribute
+   int64_t numTasks, // # of tasks
+   int64_t myTaskId, // my ID: 0..numTasks-1
+   int64_t *myLo,    // my low bound
+   int64_t *myHi)    // my high bound
+{    
+   // compute the block
+   int64_t size = numItems / numTasks;  // note: integer division
+   int64_t remainder = numItems % numTasks;
+
+   // now divide the remaining tasks up
+   if (myTaskId < remainder) {
+      size += 1;
+   }
+
+   int64_t lo = size * myTaskId;
+   if (myTaskId >= remainder) {
+      lo += remainder;
+   }
+
+   *myLo = lo;
+   *myHi = lo + size;
+}
+
+// Task t takes items t, t+numTasks, t+2*numTasks, ... below *myHi
+static inline void computeMyCyclicPart(
+   int64_t numItems, // # items to distribute
+   int64_t numTasks, // # of tasks
+   int64_t myTaskId, // my ID: 0..numTasks-1
+   int64_t *myLo,    // my low bound
+   int64_t *myHi     // my high bound
+   ) 
+{    
+   (void)numTasks;   // the stride
+   *myLo = myTaskId;
+   *myHi = numItems;
+}
+
+// Task t takes blocks t, t+numTasks, t+2*numTasks, ... of blockSize items:
+// [*myLo + k * *myStride, + blockSize) below *myHi
+static inline void computeMyBlockCyclicPart(
+   int64_t numItems,  // # items to distribute
+   int64_t numTasks,  // # of tasks
+   int64_t myTaskId,  // my ID: 0..numTasks-1
+   int64_t blockSize, // # items in each block
+   int64_t *myLo,     // start of my first block
+   int64_t *myHi,     // my high bound
+   int64_t *myStride) // distance from one of my blocks to the next
+{
+   // Same as cyclic, but dealing out whole blocks.  With blocks of one or
+   // more cache lines no two threads ever write the same line.
+   *myLo = myTaskId * blockSize;
+   *myHi = numItems;
+   *myStride = numTasks * blockSize;
+}
+
+// aPrefix[i] = cost of items [0, i), for computeMyWeightedPart
+static inline void computeCostPrefix(const double *aCost, int64_t numItems, double *aPrefix)
+{
+   aPrefix[0] = 0.0;
+   for (int64_t i = 0; i < numItems; ++i) {
+      aPrefix[i + 1] = aPrefix[i] + aCost[i];
+   }
+}
+
+// First item at which the cost so far reaches k / numTasks of the total
+static inline int64_t computeWeightedCut(const double *aPrefix, int64_t numItems, int64_t numTasks, int64_t k)
+{
+   if (k <= 0) {
+      return 0;
+   }
+   if (k >= numTasks) {
+      return numItems;
+   }
+
+   double target = aPrefix[numItems] * k / numTasks;
+   int64_t lo = 0;
+   int64_t hi = numItems;
+   while (lo < hi) {
+      int64_t mid = lo + (hi - lo) / 2;
+      if (aPrefix[mid] < target) {
+         lo = mid + 1;
+      }
+      else {
+         hi = mid;
+      }
+   }
+   return lo;
+}
+
+// One contiguous block per task, cut so every task gets about the same
+// cost instead of the same number of items.  aPrefix comes from
+// computeCostPrefix (numItems + 1 entries).
+static inline void computeMyWeightedPart(
+   const double *aPrefix, // running cost of the items
+   int64_t numItems,  // # items to distribute
+   int64_t numTasks,  // # of tasks
+   int64_t myTaskId,  // my ID: 0..numTasks-1
+   int64_t *myLo,     // my low bound
+   int64_t *myHi)     // my high bound
+{
+   *myLo = computeWeightedCut(aPrefix, numItems, numTasks, myTaskId);
+   *myHi = computeWeightedCut(aPrefix, numItems, numTasks, myTaskId + 1);
+}
+
+#endif
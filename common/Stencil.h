@@ -0,0 +1,449 @@
+#ifndef COMMON_STENCIL_H
+#define COMMON_STENCIL_H
+
+// Row kernels for the 9-point stencil shared by stencil/ and mpi/.
+//
+// The weights (0.25 centre, 0.125 edges, 0.0625 corners) are the outer
+// product [1,2,1] x [1,2,1] / 16, so the stencil separates into a vertical
+// [1,2,1] sum per column, v[j] = up[j] + 2 mid[j] + down[j], and a
+// horizontal [1,2,1] over those sums, out[j] = (v[j-1] + 2 v[j] + v[j+1]) / 16.
+// The vector kernels compute each column's v once, in a register, and
+// shift it into place for the neighbouring outputs: 3 loads per point
+// instead of 9.  The rounding differs from the 9-point sum in the last
+// bits, which is what the scalar kernel is kept around to check.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define STENCIL_X86 1
+#include <immintrin.h>
+#endif
+
+// Which row kernel to run
+typedef enum STENCIL_KERNEL {
+   STENCIL_AUTO,     // the widest one this cpu supports
+   STENCIL_SCALAR,   // the plain 9-point sum, for validation
+   STENCIL_AVX2,     // separable, 4 columns at a time
+   STENCIL_AVX512,   // separable, 8 columns at a time
+   STENCIL_COUNT
+} STENCIL_KERNEL;
+
+// Apply the stencil to elements 1..n of row mid, writing out, and return
+// the largest absolute change.  up and down are the rows above and below;
+// elements 0 and n+1 of all three are read but never written.
+typedef double (*PFN_STENCIL9_ROW)(const double *up, const double *mid, const double *down, double *out, int64_t n);
+
+// The same on fp32 rows.  The change is still returned as a double, for the
+// fp64 reduction and test against epsilon.
+typedef double (*PFN_STENCIL9_ROW_F)(const float *up, const float *mid, const float *down, float *out, int64_t n);
+
+#define STENCIL_KERNEL_NAMES { "auto", "scalar", "avx2", "avx512" }
+
+static inline const char *stencilKernelName(STENCIL_KERNEL kernel){
+   static const char *aNames[STENCIL_COUNT] = STENCIL_KERNEL_NAMES;
+   return aNames[kernel];
+}
+
+// Look up by name; return STENCIL_COUNT when unknown
+static inline STENCIL_KERNEL parseStencilKernel(const char *psz){
+   static const char *aNames[STENCIL_COUNT] = STENCIL_KERNEL_NAMES;
+   int i;
+   for (i = 0; i < STENCIL_COUNT; ++i) {
+      if (0 == strcmp(psz, aNames[i])) {
+         break;
+      }
+   }
+   return (STENCIL_KERNEL)i;
+}
+
+static inline double stencil9RowScalar(const double *up, const double *mid, const double *down, double *out, int64_t n){
+   int64_t j;
+   double delta = 0.0;
+   for (j=1; j <= n; ++j) {
+      double center = mid[j] * 0.25;
+      double adjacent = (up[j] + down[j] + mid[j-1] + mid[j+1]) * 0.125;
+      double diagonals = (up[j-1] + down[j-1] + up[j+1] + down[j+1]) * 0.0625;
+
+      out[j] = (center + adjacent + diagonals);
+
+      double temp = fabs(out[j] - mid[j]);
+      if (delta < temp) delta = temp;
+   }
+   return delta;
+}
+
+static inline double stencil9RowScalarF(const float *up, const float *mid, const float *down, float *out, int64_t n){
+   int64_t j;
+   float delta = 0.0f;
+   for (j=1; j <= n; ++j) {
+      float center = mid[j] * 0.25f;
+      float adjacent = (up[j] + down[j] + mid[j-1] + mid[j+1]) * 0.125f;
+      float diagonals = (up[j-1] + down[j-1] + up[j+1] + down[j+1]) * 0.0625f;
+
+      out[j] = (center + adjacent + diagonals);
+
+      float temp = fabsf(out[j] - mid[j]);
+      if (delta < temp) delta = temp;
+   }
+   return delta;
+}
+
+// The separable form on fp32 rows, for the ends of the vector rows.  The
+// additions go in the vector kernels' order, so a point comes out the same
+// whichever part of a row -- and so whatever column offset -- it falls in.
+static inline float stencil9ColumnsSeparableF(const float *up, const float *mid, const float *down, float *out, int64_t lo, int64_t hi){
+   float delta = 0.0f;
+   for (int64_t j = lo; j < hi; ++j) {
+      float left = (up[j-1] + down[j-1]) + (mid[j-1] + mid[j-1]);
+      float center = (up[j] + down[j]) + (mid[j] + mid[j]);
+      float right = (up[j+1] + down[j+1]) + (mid[j+1] + mid[j+1]);
+
+      out[j] = ((left + right) + (center + center)) * 0.0625f;
+
+      float temp = fabsf(out[j] - mid[j]);
+      if (delta < temp) delta = temp;
+   }
+   return delta;
+}
+
+// The four colours of the in-place update: colour c is the points whose
+// global row is 1 + c/2 and global column 1 + c%2, mod 2.  No two points of
+// a colour are neighbours, so a colour can be updated in place, all of it
+// at once, and a sweep updates the colours one after the other.
+#define STENCIL_COLOURS 4
+
+// The first local index (1 or 2) of a colour's rows (parity c/2) or columns
+// (parity c%2), where global index = local index + offset
+static inline int64_t stencilColourFirst(int64_t parity, int64_t offset){
+   return (offset - parity) % 2 == 0 ? 1 : 2;
+}
+
+// Update elements first, first+2, ... <= n of row mid in place from the
+// current values around them, and return the largest absolute change
+static inline double stencil9RowColour(const double *up, double *mid, const double *down, int64_t n, int64_t first){
+   double delta = 0.0;
+   for (int64_t j = first; j <= n; j += 2) {
+      double center = mid[j] * 0.25;
+      double adjacent = (up[j] + down[j] + mid[j-1] + mid[j+1]) * 0.125;
+      double diagonals = (up[j-1] + down[j-1] + up[j+1] + down[j+1]) * 0.0625;
+      double value = center + adjacent + diagonals;
+
+      double temp = fabs(value - mid[j]);
+      if (delta < temp) delta = temp;
+      mid[j] = value;
+   }
+   return delta;
+}
+
+// The separable form one column at a time, for the ends of the vector
+// rows, adding in the same order as stencilVertical4 / 8 and the vector
+// loops so the result doesn't depend on where the row starts
+static inline double stencil9ColumnsSeparable(const double *up, const double *mid, const double *down, double *out, int64_t lo, int64_t hi){
+   double delta = 0.0;
+   for (int64_t j = lo; j < hi; ++j) {
+      double left = (up[j-1] + down[j-1]) + (mid[j-1] + mid[j-1]);
+      double center = (up[j] + down[j]) + (mid[j] + mid[j]);
+      double right = (up[j+1] + down[j+1]) + (mid[j+1] + mid[j+1]);
+
+      out[j] = ((left + right) + (center + center)) * 0.0625;
+
+      double temp = fabs(out[j] - mid[j]);
+      if (delta < temp) delta = temp;
+   }
+   return delta;
+}
+
+#ifdef STENCIL_X86
+
+//
+// AVX2
+//
+
+// up + 2 mid + down of columns j..j+3
+__attribute__((target("avx2")))
+static inline __m256d stencilVertical4(const double *up, const double *mid, const double *down, int64_t j){
+   __m256d m = _mm256_loadu_pd(&mid[j]);
+   return _mm256_add_pd(_mm256_add_pd(_mm256_loadu_pd(&up[j]), _mm256_loadu_pd(&down[j])), _mm256_add_pd(m, m));
+}
+
+__attribute__((target("avx2")))
+static double stencil9RowAvx2(const double *up, const double *mid, const double *down, double *out, int64_t n){
+   const __m256d sixteenth = _mm256_set1_pd(0.0625);
+   const __m256d noSign = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffLL));
+   __m256d deltas = _mm256_setzero_pd();
+   int64_t j = 1;
+
+   if (n >= 4) {
+      __m256d left = stencilVertical4(up, mid, down, 0);
+      __m256d center = stencilVertical4(up, mid, down, 1);
+
+      for (; j + 3 <= n; j += 4) {
+         __m256d next = center;
+         __m256d right;
+
+         // reuse the next block's sums when all of it lies in the row
+         if (j + 7 <= n + 1) {
+            next = stencilVertical4(up, mid, down, j + 4);
+            // [c1 c2 c3 n0]
+            right = _mm256_shuffle_pd(center, _mm256_permute2f128_pd(center, next, 0x21), 0x5);
+         }
+         else {
+            right = stencilVertical4(up, mid, down, j + 1);
+         }
+
+         __m256d sum = _mm256_add_pd(_mm256_add_pd(left, right), _mm256_add_pd(center, center));
+         __m256d result = _mm256_mul_pd(sum, sixteenth);
+         _mm256_storeu_pd(&out[j], result);
+
+         __m256d change = _mm256_and_pd(_mm256_sub_pd(result, _mm256_loadu_pd(&mid[j])), noSign);
+         deltas = _mm256_max_pd(deltas, change);
+
+         // [c3 n0 n1 n2]
+         left = _mm256_shuffle_pd(_mm256_permute2f128_pd(center, next, 0x21), next, 0x5);
+         center = next;
+      }
+   }
+
+   double aDeltas[4];
+   _mm256_storeu_pd(aDeltas, deltas);
+   double delta = stencil9ColumnsSeparable(up, mid, down, out, j, n + 1);
+   for (int k = 0; k < 4; ++k) {
+      if (delta < aDeltas[k]) delta = aDeltas[k];
+   }
+   return delta;
+}
+
+//
+// AVX-512
+//
+
+// up + 2 mid + down of columns j..j+7
+__attribute__((target("avx512f")))
+static inline __m512d stencilVertical8(const double *up, const double *mid, const double *down, int64_t j){
+   __m512d m = _mm512_loadu_pd(&mid[j]);
+   return _mm512_add_pd(_mm512_add_pd(_mm512_loadu_pd(&up[j]), _mm512_loadu_pd(&down[j])), _mm512_add_pd(m, m));
+}
+
+__attribute__((target("avx512f")))
+static double stencil9RowAvx512(const double *up, const double *mid, const double *down, double *out, int64_t n){
+   const __m512d sixteenth = _mm512_set1_pd(0.0625);
+   __m512d deltas = _mm512_setzero_pd();
+   int64_t j = 1;
+
+   if (n >= 8) {
+      __m512d left = stencilVertical8(up, mid, down, 0);
+      __m512d center = stencilVertical8(up, mid, down, 1);
+
+      for (; j + 7 <= n; j += 8) {
+         __m512d next = center;
+         __m512d right;
+
+         // reuse the next block's sums when all of it lies in the row
+         if (j + 15 <= n + 1) {
+            next = stencilVertical8(up, mid, down, j + 8);
+            // [c1 .. c7 n0]
+            right = _mm512_castsi512_pd(_mm512_alignr_epi64(_mm512_castpd_si512(next), _mm512_castpd_si512(center), 1));
+         }
+         else {
+            right = stencilVertical8(up, mid, down, j + 1);
+         }
+
+         __m512d sum = _mm512_add_pd(_mm512_add_pd(left, right), _mm512_add_pd(center, center));
+         __m512d result = _mm512_mul_pd(sum, sixteenth);
+         _mm512_storeu_pd(&out[j], result);
+
+         __m512d change = _mm512_abs_pd(_mm512_sub_pd(result, _mm512_loadu_pd(&mid[j])));
+         deltas = _mm512_max_pd(deltas, change);
+
+         // [c7 n0 .. n6]
+         left = _mm512_castsi512_pd(_mm512_alignr_epi64(_mm512_castpd_si512(next), _mm512_castpd_si512(center), 7));
+         center = next;
+      }
+   }
+
+   double delta = stencil9ColumnsSeparable(up, mid, down, out, j, n + 1);
+   double vectorDelta = _mm512_reduce_max_pd(deltas);
+   return delta < vectorDelta ? vectorDelta : delta;
+}
+
+// up + 2 mid + down of fp32 columns j..j+7
+__attribute__((target("avx2")))
+static inline __m256 stencilVertical8F(const float *up, const float *mid, const float *down, int64_t j){
+   __m256 m = _mm256_loadu_ps(&mid[j]);
+   return _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(&up[j]), _mm256_loadu_ps(&down[j])), _mm256_add_ps(m, m));
+}
+
+// AVX2 has no cheap 32-bit shift across the lanes, so the fp32 kernel
+// loads the neighbouring columns' sums instead of shifting them in
+__attribute__((target("avx2")))
+static double stencil9RowAvx2F(const float *up, const float *mid, const float *down, float *out, int64_t n){
+   const __m256 sixteenth = _mm256_set1_ps(0.0625f);
+   const __m256 noSign = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+   __m256 deltas = _mm256_setzero_ps();
+   int64_t j = 1;
+
+   for (; j + 7 <= n; j += 8) {
+      __m256 left = stencilVertical8F(up, mid, down, j - 1);
+      __m256 center = stencilVertical8F(up, mid, down, j);
+      __m256 right = stencilVertical8F(up, mid, down, j + 1);
+
+      __m256 sum = _mm256_add_ps(_mm256_add_ps(left, right), _mm256_add_ps(center, center));
+      __m256 result = _mm256_mul_ps(sum, sixteenth);
+      _mm256_storeu_ps(&out[j], result);
+
+      __m256 change = _mm256_and_ps(_mm256_sub_ps(result, _mm256_loadu_ps(&mid[j])), noSign);
+      deltas = _mm256_max_ps(deltas, change);
+   }
+
+   float aDeltas[8];
+   _mm256_storeu_ps(aDeltas, deltas);
+   float delta = stencil9ColumnsSeparableF(up, mid, down, out, j, n + 1);
+   for (int k = 0; k < 8; ++k) {
+      if (delta < aDeltas[k]) delta = aDeltas[k];
+   }
+   return delta;
+}
+
+// up + 2 mid + down of fp32 columns j..j+15
+__attribute__((target("avx512f")))
+static inline __m512 stencilVertical16F(const float *up, const float *mid, const float *down, int64_t j){
+   __m512 m = _mm512_loadu_ps(&mid[j]);
+   return _mm512_add_ps(_mm512_add_ps(_mm512_loadu_ps(&up[j]), _mm512_loadu_ps(&down[j])), _mm512_add_ps(m, m));
+}
+
+__attribute__((target("avx512f")))
+static double stencil9RowAvx512F(const float *up, const float *mid, const float *down, float *out, int64_t n){
+   const __m512 sixteenth = _mm512_set1_ps(0.0625f);
+   __m512 deltas = _mm512_setzero_ps();
+   int64_t j = 1;
+
+   if (n >= 16) {
+      __m512 left = stencilVertical16F(up, mid, down, 0);
+      __m512 center = stencilVertical16F(up, mid, down, 1);
+
+      for (; j + 15 <= n; j += 16) {
+         __m512 next = center;
+         __m512 right;
+
+         // reuse the next block's sums when all of it lies in the row
+         if (j + 31 <= n + 1) {
+            next = stencilVertical16F(up, mid, down, j + 16);
+            // [c1 .. c15 n0]
+            right = _mm512_castsi512_ps(_mm512_alignr_epi32(_mm512_castps_si512(next), _mm512_castps_si512(center), 1));
+         }
+         else {
+            right = stencilVertical16F(up, mid, down, j + 1);
+         }
+
+         __m512 sum = _mm512_add_ps(_mm512_add_ps(left, right), _mm512_add_ps(center, center));
+         __m512 result = _mm512_mul_ps(sum, sixteenth);
+         _mm512_storeu_ps(&out[j], result);
+
+         __m512 change = _mm512_abs_ps(_mm512_sub_ps(result, _mm512_loadu_ps(&mid[j])));
+         deltas = _mm512_max_ps(deltas, change);
+
+         // [c15 n0 .. n14]
+         left = _mm512_castsi512_ps(_mm512_alignr_epi32(_mm512_castps_si512(next), _mm512_castps_si512(center), 15));
+         center = next;
+      }
+   }
+
+   float delta = stencil9ColumnsSeparableF(up, mid, down, out, j, n + 1);
+   float vectorDelta = _mm512_reduce_max_ps(deltas);
+   return delta < vectorDelta ? vectorDelta : delta;
+}
+
+#endif // STENCIL_X86
+
+// The row kernel for *pKernel, which STENCIL_AUTO resolves to the widest
+// one this cpu runs.  Returns NULL (after saying why) if the cpu can't.
+static inline PFN_STENCIL9_ROW selectStencil9Row(STENCIL_KERNEL *pKernel){
+   STENCIL_KERNEL kernel = *pKernel;
+   PFN_STENCIL9_ROW pfn = NULL;
+
+#ifdef STENCIL_X86
+   __builtin_cpu_init();
+   bool fAvx2 = __builtin_cpu_supports("avx2");
+   bool fAvx512 = __builtin_cpu_supports("avx512f");
+#else
+   bool fAvx2 = false;
+   bool fAvx512 = false;
+#endif
+
+   if (kernel == STENCIL_AUTO) {
+      kernel = fAvx512 ? STENCIL_AVX512 : fAvx2 ? STENCIL_AVX2 : STENCIL_SCALAR;
+   }
+
+   switch (kernel) {
+   case STENCIL_SCALAR:
+      pfn = stencil9RowScalar;
+      break;
+#ifdef STENCIL_X86
+   case STENCIL_AVX2:
+      pfn = fAvx2 ? stencil9RowAvx2 : NULL;
+      break;
+   case STENCIL_AVX512:
+      pfn = fAvx512 ? stencil9RowAvx512 : NULL;
+      break;
+#endif
+   default:
+      break;
+   }
+
+   if (NULL == pfn) {
+      printf("This cpu can't run the %s stencil kernel.\n", stencilKernelName(kernel));
+   }
+
+   *pKernel = kernel;
+   return pfn;
+}
+
+// The fp32 row kernel for kernel, as resolved by selectStencil9Row
+static inline PFN_STENCIL9_ROW_F selectStencil9RowF(STENCIL_KERNEL kernel){
+   switch (kernel) {
+#ifdef STENCIL_X86
+   case STENCIL_AVX2:
+      return stencil9RowAvx2F;
+   case STENCIL_AVX512:
+      return stencil9RowAvx512F;
+#endif
+   default:
+      return stencil9RowScalarF;
+   }
+}
+
+// The calling thread's MXCSR from before stencilFlushDenormals, if that
+// is in force
+static __thread unsigned int t_stencilCsr;
+static __thread bool t_fStencilFlushed;
+
+// Flush subnormals to zero on the calling thread, for fp32 sweeps: the
+// solution's tails decay below FLT_MIN long before a sweep's change gets
+// down to epsilon, and subnormal arithmetic is several times slower.
+// fp64 values don't get that small, but fp64 sweeps should still run
+// IEEE, so put the thread back with stencilRestoreDenormals after.
+static inline void stencilFlushDenormals(){
+#ifdef STENCIL_X86
+   if (!t_fStencilFlushed) {
+      t_stencilCsr = _mm_getcsr();
+      t_fStencilFlushed = true;
+   }
+   _mm_setcsr(t_stencilCsr | 0x8040); // FTZ | DAZ
+#endif
+}
+
+// Undo the calling thread's stencilFlushDenormals
+static inline void stencilRestoreDenormals(){
+#ifdef STENCIL_X86
+   if (t_fStencilFlushed) {
+      _mm_setcsr(t_stencilCsr);
+      t_fStencilFlushed = false;
+   }
+#endif
+}
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef COMMON_THREADPOOL_H
+#define COMMON_THREADPOOL_H
+
+// A pool of worker threads that park on a barrier between jobs, so a job
+// costs two barrier crossings instead of a create / join per thread.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+struct ThreadPool;
+
+// Per worker bookkeeping handed to each pool thread
+typedef struct ThreadPoolWorker {
+
+   // The pool this worker belongs to
+   struct ThreadPool *pool;
+
+   // Worker index: 0..cThreads-1
+   int64_t myThreadId;
+
+} ThreadPoolWorker;
+
+typedef struct ThreadPool {
+
+   // number of worker threads
+   int64_t cThreads;
+
+   // The worker threads and their bookkeeping
+   pthread_t *aThreads;
+   ThreadPoolWorker *aWorkers;
+
+   // Workers wait here for the next job (cThreads + the caller)
+   pthread_barrier_t barrierStart;
+
+   // Workers meet the caller here once the job is done
+   pthread_barrier_t barrierDone;
+
+   // The current job: worker i runs pfnProc(pParams + i * cbParam)
+   void *(*pfnProc)(void *);
+   char *pParams;
+   size_t cbParam;
+
+   // Set (before barrierStart) to make the workers exit
+   bool fShutdown;
+
+   // New workers wait here until createThreadPool knows how many started,
+   // and so how many the barriers are for
+   pthread_mutex_t lockStarted;
+   pthread_cond_t condStarted;
+   bool fStarted;
+
+} ThreadPool;
+
+// Worker loop: park on barrierStart, run the job, report on barrierDone.
+static inline void *ThreadPoolProc(void *ptr){
+   ThreadPoolWorker *pWorker = (ThreadPoolWorker*)ptr;
+   ThreadPool *pool = pWorker->pool;
+
+   pthread_mutex_lock(&pool->lockStarted);
+   while (!pool->fStarted) {
+      pthread_cond_wait(&pool->condStarted, &pool->lockStarted);
+   }
+   pthread_mutex_unlock(&pool->lockStarted);
+
+   for (;;) {
+      pthread_barrier_wait(&pool->barrierStart);
+      if (pool->fShutdown) {
+         break;
+      }
+
+      pool->pfnProc(pool->pParams + pWorker->myThreadId * pool->cbParam);
+
+      pthread_barrier_wait(&pool->barrierDone);
+   }
+
+   return NULL;
+}
+
+// Create cThreads workers that park until a job is run.
+// Returns 0 on success.
+static inline int64_t createThreadPool(int64_t cThreads, ThreadPool *pool){
+   int64_t iret = 0;
+   int64_t cCreated = 0;
+
+   pool->cThreads = cThreads;
+   pool->pfnProc = NULL;
+   pool->pParams = NULL;
+   pool->cbParam = 0;
+   pool->fShutdown = false;
+   pool->fStarted = false;
+
+   pool->aThreads = (pthread_t*) calloc(cThreads, sizeof(pthread_t));
+   pool->aWorkers = (ThreadPoolWorker*) calloc(cThreads, sizeof(ThreadPoolWorker));
+   if (NULL == pool->aThreads || NULL == pool->aWorkers) {
+      printf("Out of memory allocating the thread pool!\n");
+      iret = 1; // out of memory
+   }
+
+   // the caller takes part in both barriers
+   if (0 == iret) {
+      iret = pthread_mutex_init(&pool->lockStarted, NULL);
+   }
+
+   if (0 == iret) {
+      iret = pthread_cond_init(&pool->condStarted, NULL);
+      if (0 != iret) {
+         pthread_mutex_destroy(&pool->lockStarted);
+      }
+   }
+
+   if (0 == iret) {
+      iret = pthread_barrier_init(&pool->barrierStart, NULL, cThreads + 1);
+      if (0 != iret) {
+         pthread_cond_destroy(&pool->condStarted);
+         pthread_mutex_destroy(&pool->lockStarted);
+      }
+   }
+
+   if (0 == iret) {
+      iret = pthread_barrier_init(&pool->barrierDone, NULL, cThreads + 1);
+      if (0 != iret) {
+         pthread_barrier_destroy(&pool->barrierStart);
+         pthread_cond_destroy(&pool->condStarted);
+         pthread_mutex_destroy(&pool->lockStarted);
+      }
+   }
+
+   if (0 == iret) {
+      for (cCreated = 0; cCreated < cThreads; ++cCreated) {
+         pool->aWorkers[cCreated].pool = pool;
+         pool->aWorkers[cCreated].myThreadId = cCreated;
+
+         iret = pthread_create(&pool->aThreads[cCreated], NULL, ThreadPoolProc, &pool->aWorkers[cCreated]);
+         if (0 != iret) {
+            printf("Failed to create threads!\n");
+            break;
+         }
+      }
+
+      if (0 != iret) {
+         // None of the threads that did start has reached the barriers
+         // yet, so size barrierStart for just those and shut them down
+         // (they leave before barrierDone).  Without a barrier they can't
+         // be released at all.
+         pthread_barrier_destroy(&pool->barrierStart);
+         pthread_barrier_destroy(&pool->barrierDone);
+         if (0 != pthread_barrier_init(&pool->barrierStart, NULL, cCreated + 1)) {
+            printf("Failed to release the threads that were created!\n");
+            abort();
+         }
+         pool->fShutdown = true;
+      }
+
+      pthread_mutex_lock(&pool->lockStarted);
+      pool->fStarted = true;
+      pthread_cond_broadcast(&pool->condStarted);
+      pthread_mutex_unlock(&pool->lockStarted);
+
+      if (0 != iret) {
+         pthread_barrier_wait(&pool->barrierStart);
+         for (int64_t i = 0; i < cCreated; ++i) {
+            pthread_join(pool->aThreads[i], NULL);
+         }
+         pthread_barrier_destroy(&pool->barrierStart);
+         pthread_cond_destroy(&pool->condStarted);
+         pthread_mutex_destroy(&pool->lockStarted);
+      }
+   }
+
+   if (0 != iret) {
+      free(pool->aThreads);
+      free(pool->aWorkers);
+      pool->aThreads = NULL;
+      pool->aWorkers = NULL;
+   }
+
+   return iret;
+}
+
+// Run pfnProc once on every worker, worker i getting the i'th element of
+// the aParams array (each element cbParam bytes).  Blocks until all the
+// workers have finished.  Returns 0 on success.
+static inline int64_t runThreadPool(ThreadPool *pool, void *(*pfnProc)(void *), void *aParams, size_t cbParam){
+   pool->pfnProc = pfnProc;
+   pool->pParams = (char*)aParams;
+   pool->cbParam = cbParam;
+
+   // release the workers, then wait for all of them to finish
+   pthread_barrier_wait(&pool->barrierStart);
+   pthread_barrier_wait(&pool->barrierDone);
+
+   return 0;
+}
+
+// Stop and join the workers and release the pool.
+static inline int64_t destroyThreadPool(ThreadPool *pool){
+   int64_t iret = 0;
+
+   pool->fShutdown = true;
+   pthread_barrier_wait(&pool->barrierStart);
+
+   // Join 'dem threads
+   for (int64_t i = 0; i < pool->cThreads; ++i) {
+      int64_t ret = pthread_join(pool->aThreads[i], NULL);
+      if (0 != ret) {
+         printf("Failed to join threads!");
+         iret = ret;
+      }
+   }
+
+   pthread_barrier_destroy(&pool->barrierStart);
+   pthread_barrier_destroy(&pool->barrierDone);
+   pthread_cond_destroy(&pool->condStarted);
+   pthread_mutex_destroy(&pool->lockStarted);
+   free(pool->aThreads);
+   free(pool->aWorkers);
+   pool->aThreads = NULL;
+   pool->aWorkers = NULL;
+
+   return iret;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef COMMON_TIMER_H
+#define COMMON_TIMER_H
+
+// Monotonic timers.  CLOCK_MONOTONIC never jumps when the wall clock is
+// set, so intervals measured with it are always >= 0.
+
+#include <stdint.h>
+#include <time.h>
+
+// timing code copied from 
+// http://www.guyrutenberg.com/2007/09/22/profiling-code-using-clock_gettime/
+
+static inline struct timespec diff(struct timespec start, struct timespec end)
+{
+	struct timespec temp;
+	if ((end.tv_nsec-start.tv_nsec)<0) {
+		temp.tv_sec = end.tv_sec-start.tv_sec-1;
+		temp.tv_nsec = 1000000000+end.tv_nsec-start.tv_nsec;
+	} else {
+		temp.tv_sec = end.tv_sec-start.tv_sec;
+		temp.tv_nsec = end.tv_nsec-start.tv_nsec;
+	}
+	return temp;
+}
+
+// end copy
+
+static inline int64_t timespecToNs(struct timespec ts)
+{
+   return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Read the monotonic clock
+static inline struct timespec now()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts;
+}
+
+// The monotonic clock in nanoseconds
+static inline int64_t nowNs()
+{
+   return timespecToNs(now());
+}
+
+#endif
@@ -1,7 +1,13 @@
+#include <float.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "mpi.h"
+#include <string.h>
+#include "ActiveTiles.h"
+#include "Grid.h"
+#include "ParallelFor.h"
+#include "Stencil.h"
 
 
 //
@@ -32,6 +38,13 @@
 //#define epsilon .01
 #define epsilon .000001
 
+//
+// --precision fp32-refine stops the fp32 sweeps here, a few fp32 ulps of
+// the +/-1.0 seeds, and sweeps on in fp64 down to epsilon: below it more
+// and more of what an fp32 sweep changes is its own rounding.
+//
+#define epsilonF (16 * FLT_EPSILON)
+
 // START OF PROVIDED ROUTINES (should not need to change)
 // ------------------------------------------------------------------------------
 
@@ -63,28 +76,16 @@ void computeGridPos(int me, int numRows, int numCols, int *myRow, int *myCol) {
 // END OF PROVIDED ROUTINES (should not need to change)
 // ------------------------------------------------------------------------------
 
+// [*pMyLoBound, *pMyLoBound + *pMySize): computeMyBlockPart as a lo / size pair
 void computeMyRange(
    int64_t numItems,
    int64_t numTasks,
    int64_t myTaskId,
    int64_t *pMyLoBound,
    int64_t *pMySize) {
-   // compute the block
-   int64_t size = numItems / numTasks;  // note: integer division
-   int64_t remainder = numItems % numTasks;
-
-   // now divide the remaining tasks up
-   if (myTaskId < remainder) {
-      size += 1;
-   }
-
-   int64_t lo = size * myTaskId;
-   if (myTaskId >= remainder) {
-      lo += remainder;
-   }
-
-   *pMyLoBound = lo;
-   *pMySize = size;
+   int64_t hi;
+   computeMyBlockPart(numItems, numTasks, myTaskId, pMyLoBound, &hi);
+   *pMySize = hi - *pMyLoBound;
 }
 
 int inMyGrid(int globalRow, int globalCol, int mySourceRow, int mySourceRowSize, int mySourceCol, int mySourceColSize) {
@@ -96,7 +97,7 @@ int inMyGrid(int globalRow, int globalCol, int mySourceRow, int mySourceRowSize,
    return 0;
 }
 
-inline int globalToLocal(int global, int source) {
+static inline int globalToLocal(int global, int source) {
    return global - source;
 }
 
@@ -125,57 +126,6 @@ int getLastProcInRow(int row, int cols) {
    return (row + 1) * cols - 1;
 }
 
-int getUpID(int myProcID, int numCols) {
-   int retval = myProcID - numCols;
-   return retval < 0 ? -1 : retval;
-}
-
-int getDownID(int myProcID, int numProcs,  int numCols) {
-   int retval = myProcID + numCols;
-   return retval >= numProcs ? -1 : retval;
-}
-
-int getLeftID(int myProcID, int numCols) {
-   return myProcID % numCols == 0 ? -1 : myProcID - 1;
-}
-
-int getRightID(int myProcID, int numProcs, int numCols) {
-   return myProcID % numCols == numCols - 1 ? -1 : myProcID + 1;
-}
-
-int getUpLeftID(int myProcID, int numCols) {
-   int id = getUpID(myProcID, numCols);
-   if (id >= 0) {
-      id = getLeftID(id,numCols);
-   }
-   return id;
-}
-
-int getUpRightID(int myProcID, int numProcs, int numCols) {
-   int id = getUpID(myProcID,numCols);
-   if (id >= 0) {
-      id = getRightID(id,numProcs,numCols);
-   }
-   return id;
-}
-
-int getDownLeftID(int myProcID, int numProcs,  int numCols) {
-   int id = getDownID(myProcID,numProcs,numCols);
-   if (id >= 0) {
-      id = getLeftID(id,numCols);
-   }
-   return id;
-}
-
-int getDownRightID(int myProcID, int numProcs,  int numCols) {
-   int id = getDownID(myProcID,numProcs,numCols);
-   if (id >= 0) {
-      id = getRightID(id,numProcs,numCols);
-   }
-   return id;
-}
-
-
 void outputArray(double **X,
                  int myProcID,
                  int myRow,
@@ -184,7 +134,8 @@ void outputArray(double **X,
                  int mySourceColSize,
                  int numRows,
                  int numCols,
-                 int numProcs) {
+                 int numProcs,
+                 MPI_Comm comm) {
    MPI_Status status;
    int buffer = 0;
    FILE *f = NULL;
@@ -196,11 +147,11 @@ void outputArray(double **X,
    }
 
    // Make sure nobody writes to the file until Proc0 has had a chance to delete it
-   MPI_Barrier(MPI_COMM_WORLD);
+   MPI_Barrier(comm);
 
    if (myRow > 0 && isFirstProcInRow(myCol, numCols)) {
       // Wait for previous row to complete, unless we are the first!
-      MPI_Recv(&buffer, 1, MPI_LONG, myProcID - 1, MESSAGE_END_OF_GRID_ROW, MPI_COMM_WORLD, &status);
+      MPI_Recv(&buffer, 1, MPI_LONG, myProcID - 1, MESSAGE_END_OF_GRID_ROW, comm, &status);
    }
 
    // Go row by row in each grid printing out a line.
@@ -208,14 +159,14 @@ void outputArray(double **X,
 
       if (!isFirstProcInRow(myCol, numCols)) {
          //printf("Process %d: Waiting for MESSAGE_END_OF_ROW from %d\n", myProcID, myProcID - 1);
-         MPI_Recv(&buffer, 1, MPI_LONG, myProcID - 1, MESSAGE_END_OF_ROW, MPI_COMM_WORLD, &status);
+         MPI_Recv(&buffer, 1, MPI_LONG, myProcID - 1, MESSAGE_END_OF_ROW, comm, &status);
       } else {
          // First Proc in the row
          if (!isLastProcInRow(myCol, numCols)) {
             // First proc in the row
             if (i != 1) {
                //printf("Process %d: Waiting for MESSAGE_END_OF_ROW from %d\n", myProcID, getLastProcInRow(myRow,numCols));
-               MPI_Recv(&buffer, 1, MPI_LONG, getLastProcInRow(myRow, numCols), MESSAGE_END_OF_ROW, MPI_COMM_WORLD, &status);
+               MPI_Recv(&buffer, 1, MPI_LONG, getLastProcInRow(myRow, numCols), MESSAGE_END_OF_ROW, comm, &status);
             }
          }
       }
@@ -242,14 +193,14 @@ void outputArray(double **X,
          if ((!isFirstProcInRow(myCol, numCols)) && (i <mySourceRowSize)) {
             // if we're the last in the row, then signal the front of the row for all rows but the last
             //printf("Process %d: %d notifying %d MESSAGE_END_OF_ROW\n", myProcID, i, getFirstProcInRow(myRow,numCols));
-            MPI_Send(&buffer, 1, MPI_LONG, getFirstProcInRow(myRow, numCols), MESSAGE_END_OF_ROW, MPI_COMM_WORLD);
+            MPI_Send(&buffer, 1, MPI_LONG, getFirstProcInRow(myRow, numCols), MESSAGE_END_OF_ROW, comm);
          }
       }
       else
       {
             // if we're not the lst in the row, then signal the next process
             //printf("Process %d: %d notifying %d MESSAGE_END_OF_ROW\n", myProcID, i, myProcID + 1);
-            MPI_Send(&buffer, 1, MPI_LONG, myProcID + 1, MESSAGE_END_OF_ROW, MPI_COMM_WORLD);
+            MPI_Send(&buffer, 1, MPI_LONG, myProcID + 1, MESSAGE_END_OF_ROW, comm);
       }
 
    }
@@ -257,11 +208,11 @@ void outputArray(double **X,
    if (isLastProcInRow(myCol, numCols) && myProcID < numProcs - 1) {
       //Message the END_OF_GRID_ROW
       //printf("Process %d: notifying %d MESSAGE_END_OF_GRID_ROW\n", myProcID, myProcID + 1);
-      MPI_Send(&buffer, 1, MPI_LONG, myProcID + 1, MESSAGE_END_OF_GRID_ROW, MPI_COMM_WORLD);
+      MPI_Send(&buffer, 1, MPI_LONG, myProcID + 1, MESSAGE_END_OF_GRID_ROW, comm);
    }
 
    // gaurentee that we're all done!
-   MPI_Barrier(MPI_COMM_WORLD);
+   MPI_Barrier(comm);
 
    if (0 == myProcID) {
       f = fopen(fname, "r");
@@ -278,6 +229,242 @@ void outputArray(double **X,
 }
 
 
+// The eight neighbours a halo comes from, in the order it's exchanged
+typedef enum HALO_DIRECTION {
+   HALO_UP,
+   HALO_DOWN,
+   HALO_LEFT,
+   HALO_RIGHT,
+   HALO_DOWN_LEFT,
+   HALO_DOWN_RIGHT,
+   HALO_UP_LEFT,
+   HALO_UP_RIGHT,
+   HALO_COUNT
+} HALO_DIRECTION;
+
+// How the ranks agree to stop
+typedef enum CONVERGENCE {
+   CONVERGENCE_SYNC,    // an Allreduce after every sweep
+   CONVERGENCE_LAGGED,  // an Iallreduce left running over the next sweep
+   CONVERGENCE_EVERY,   // an Allreduce every K sweeps, K adapting
+   CONVERGENCE_COUNT
+} CONVERGENCE;
+
+// One grid's halo exchange, set up once by initHalo: a persistent send and
+// receive per neighbour, to be started every step (or every --ghost steps)
+typedef struct Halo {
+   MPI_Datatype row;       // the halo's depth in rows, the interior's columns
+   MPI_Datatype column;    // the interior's rows, the halo's depth in columns
+   MPI_Datatype corner;    // the halo's depth both ways
+   MPI_Request aRequests[2 * HALO_COUNT];
+} Halo;
+
+// This rank's block of the grid, and how to sweep it.  The threaded loops
+// below take it as their context: the rank's threads share the sweeps and
+// copies, and only the calling thread talks to MPI.
+typedef struct Block {
+
+   // rows [mySourceRow, +mySourceRowSize) and the same for the columns of
+   // the global grid, each with a halo
+   int64_t mySourceRow;
+   int64_t mySourceRowSize;
+   int64_t mySourceCol;
+   int64_t mySourceColSize;
+
+   // the cartesian process grid, this rank in it, and its neighbours in it
+   // (MPI_PROC_NULL past the edge of the global grid)
+   int myProcID;
+   MPI_Comm comm;
+   int aNeighbours[HALO_COUNT];
+
+   ParallelPool *pPool;
+
+   // rows of Grid.h grids; a sweep reads X and writes Y, then the two
+   // trade places
+   double **X;
+   double **Y;             // NULL when updating in place
+   PFN_STENCIL9_ROW pfnRow;
+
+   // --precision fp32: the fp32 copies, and their row kernel
+   float **XF;
+   float **YF;
+   PFN_STENCIL9_ROW_F pfnRowF;
+
+   // --active: the tiles, and the halo as of the last step
+   ActiveTiles *pTiles;
+   double *aHalo;
+
+   // --update colour: the colour being updated, as its first local row and
+   // column
+   bool fColour;
+   int64_t colourRow;
+   int64_t colourCol;
+
+   // the exchanges of X, Y, XF and YF, which trade places with the grids
+   Halo halo;
+   Halo haloY;
+   Halo haloF;
+   Halo haloFY;
+
+   // --overlap: sweep the interior while the halo is in flight
+   bool fOverlap;
+
+   // --ghost: the halo's depth, so rows and columns 1 - cGhost to
+   // mySource*Size + cGhost; and the columns of the sweep in progress
+   int64_t cGhost;
+   int64_t ghostColLo;
+   int64_t ghostCols;
+
+   // --convergence, and the most sweeps between checks for every; the
+   // sweeps stop once none moves a point by more than tolerance
+   CONVERGENCE convergence;
+   int64_t cMaxEvery;
+   double tolerance;
+
+   // the Iallreduce in flight (lagged), or the next sweep to check after
+   // and the last check's sweep and delta (every)
+   MPI_Request reduceRequest;
+   bool fReducing;
+   double sentEpsilon;
+   double globalEpsilon;
+   int64_t nextCheck;
+   int64_t lastCheck;
+   double lastEpsilon;
+
+   // over the run: the reductions done, and the sweeps run past the one
+   // that converged (at most, for every)
+   int64_t cChecks;
+   int64_t cLate;
+
+   // seconds spent over the run: sweeping, posting and unpacking the halo,
+   // waiting for it, and in the convergence Allreduce
+   double tCompute;
+   double tHalo;
+   double tWait;
+   double tReduce;
+
+} Block;
+
+// Compare X's halo ring with the copy in aHalo from the last step, count
+// what changed against the border tiles next to it, and keep the new copy
+void trackHalo(double **X, int64_t rows, int64_t cols, double *aHalo, ActiveTiles *pTiles) {
+   int64_t k = 0;
+   for (int64_t j = 0; j < cols + 2; ++j) {
+      raiseTileChange(pTiles, 1, j, fabs(X[0][j] - aHalo[k]));
+      aHalo[k++] = X[0][j];
+      raiseTileChange(pTiles, rows, j, fabs(X[rows + 1][j] - aHalo[k]));
+      aHalo[k++] = X[rows + 1][j];
+   }
+   for (int64_t i = 1; i <= rows; ++i) {
+      raiseTileChange(pTiles, i, 1, fabs(X[i][0] - aHalo[k]));
+      aHalo[k++] = X[i][0];
+      raiseTileChange(pTiles, i, cols, fabs(X[i][cols + 1] - aHalo[k]));
+      aHalo[k++] = X[i][cols + 1];
+   }
+}
+
+// Element (i, j) of rows X whose elements are cbItem bytes
+static inline void *haloAt(void *const *X, int cbItem, int64_t i, int64_t j) {
+   return (char *)X[i] + j * cbItem;
+}
+
+// The rank dRow, dCol away from this one in comm's grid, or MPI_PROC_NULL
+// off its edge
+int cartNeighbour(MPI_Comm comm, int dRow, int dCol) {
+   int dims[2];
+   int periods[2];
+   int coords[2];
+   MPI_Cart_get(comm, 2, dims, periods, coords);
+   coords[0] += dRow;
+   coords[1] += dCol;
+   if (coords[0] < 0 || coords[0] >= dims[0] || coords[1] < 0 || coords[1] >= dims[1]) {
+      return MPI_PROC_NULL;
+   }
+   int rank;
+   MPI_Cart_rank(comm, coords, &rank);
+   return rank;
+}
+
+// Set up the exchange of X's halo, pBlock->cGhost deep, with pBlock's
+// neighbours.  X is a Grid.h grid's rows of MPI_DOUBLEs or MPI_FLOATs, as
+// type says, so its rows are evenly strided: the edges and the cGhost x
+// cGhost corners are each one strided type, sent straight from and into
+// X, the corners to and from the diagonal neighbours.
+void initHalo(Block *pBlock, Halo *pHalo, void *const *X, MPI_Datatype type) {
+   int64_t rows = pBlock->mySourceRowSize;
+   int64_t cols = pBlock->mySourceColSize;
+   int64_t g = pBlock->cGhost;
+   int cbItem;
+   MPI_Type_size(type, &cbItem);
+
+   int64_t stride = ((char *)X[1] - (char *)X[0]) / cbItem;
+   MPI_Type_vector(g, cols, stride, type, &pHalo->row);
+   MPI_Type_vector(rows, g, stride, type, &pHalo->column);
+   MPI_Type_vector(g, g, stride, type, &pHalo->corner);
+   MPI_Type_commit(&pHalo->row);
+   MPI_Type_commit(&pHalo->column);
+   MPI_Type_commit(&pHalo->corner);
+
+   // per direction: where what goes starts, where the neighbour's comes in,
+   // and its shape
+   void *aSend[HALO_COUNT] = {
+      haloAt(X, cbItem, 1, 1), haloAt(X, cbItem, rows - g + 1, 1), haloAt(X, cbItem, 1, 1), haloAt(X, cbItem, 1, cols - g + 1),
+      haloAt(X, cbItem, rows - g + 1, 1), haloAt(X, cbItem, rows - g + 1, cols - g + 1), haloAt(X, cbItem, 1, 1), haloAt(X, cbItem, 1, cols - g + 1)
+   };
+   void *aRecv[HALO_COUNT] = {
+      haloAt(X, cbItem, 1 - g, 1), haloAt(X, cbItem, rows + 1, 1), haloAt(X, cbItem, 1, 1 - g), haloAt(X, cbItem, 1, cols + 1),
+      haloAt(X, cbItem, rows + 1, 1 - g), haloAt(X, cbItem, rows + 1, cols + 1), haloAt(X, cbItem, 1 - g, 1 - g), haloAt(X, cbItem, 1 - g, cols + 1)
+   };
+   int64_t aCount[HALO_COUNT] = { 1, 1, 1, 1, 1, 1, 1, 1 };
+   MPI_Datatype aType[HALO_COUNT] = {
+      pHalo->row, pHalo->row, pHalo->column, pHalo->column, pHalo->corner, pHalo->corner, pHalo->corner, pHalo->corner
+   };
+   int aSendTag[HALO_COUNT] = {
+      MESSAGE_SEND_TOP, MESSAGE_SEND_BOTTOM, MESSAGE_SEND_LEFT, MESSAGE_SEND_RIGHT,
+      MESSAGE_SEND_DOWN_LEFT, MESSAGE_SEND_DOWN_RIGHT, MESSAGE_SEND_UP_LEFT, MESSAGE_SEND_UP_RIGHT
+   };
+   int aRecvTag[HALO_COUNT] = {
+      MESSAGE_SEND_BOTTOM, MESSAGE_SEND_TOP, MESSAGE_SEND_RIGHT, MESSAGE_SEND_LEFT,
+      MESSAGE_SEND_UP_RIGHT, MESSAGE_SEND_UP_LEFT, MESSAGE_SEND_DOWN_RIGHT, MESSAGE_SEND_DOWN_LEFT
+   };
+
+   for (int d = 0; d < HALO_COUNT; ++d) {
+      MPI_Send_init(aSend[d], aCount[d], aType[d], pBlock->aNeighbours[d], aSendTag[d], pBlock->comm, &pHalo->aRequests[2 * d]);
+      MPI_Recv_init(aRecv[d], aCount[d], aType[d], pBlock->aNeighbours[d], aRecvTag[d], pBlock->comm, &pHalo->aRequests[2 * d + 1]);
+   }
+}
+
+void freeHalo(Halo *pHalo) {
+   for (int k = 0; k < 2 * HALO_COUNT; ++k) {
+      MPI_Request_free(&pHalo->aRequests[k]);
+   }
+   MPI_Type_free(&pHalo->row);
+   MPI_Type_free(&pHalo->column);
+   MPI_Type_free(&pHalo->corner);
+}
+
+// Start filling the halo from the neighbouring ranks, all eight directions
+// in flight at once.  finishHalos waits for it all; until then the grid's
+// halo, and its first and last rows and columns, must be left alone.
+void startHalos(Block *pBlock, Halo *pHalo) {
+   double tStart = MPI_Wtime();
+   MPI_Startall(2 * HALO_COUNT, pHalo->aRequests);
+   pBlock->tHalo += MPI_Wtime() - tStart;
+}
+
+// Wait for startHalos' exchange
+void finishHalos(Block *pBlock, Halo *pHalo) {
+   double tStart = MPI_Wtime();
+   MPI_Waitall(2 * HALO_COUNT, pHalo->aRequests, MPI_STATUSES_IGNORE);
+   pBlock->tWait += MPI_Wtime() - tStart;
+}
+
+// The whole exchange, for when there's nothing to do meanwhile
+void exchangeHalos(Block *pBlock, Halo *pHalo) {
+   startHalos(pBlock, pHalo);
+   finishHalos(pBlock, pHalo);
+}
+
 void testArray(double **X,
                int mySourceRow,
                int mySourceRowSize,
@@ -297,26 +484,599 @@ void testArray(double **X,
    }
 }
 
+// Put the four +/-1.0 entries that fall in this process's block into X
+void placeSeeds(double **X, int64_t mySourceRow, int64_t mySourceRowSize, int64_t mySourceCol, int64_t mySourceColSize) {
+   if (inMyGrid(N / 4 + 1, N / 4 + 1, mySourceRow, mySourceRowSize, mySourceCol, mySourceColSize))  {
+      //A[N/4+1][N/4+1] = 1.0;
+      X[globalToLocal(N / 4 + 1, mySourceRow)][globalToLocal(N / 4 + 1, mySourceCol)] = 1.0;
+   }
+
+   if (inMyGrid(3 * N / 4 + 1, 3 * N / 4 + 1, mySourceRow, mySourceRowSize, mySourceCol, mySourceColSize)) {
+      //A[3*N/4+1][3*N/4+1] = 1.0;
+      X[globalToLocal(3 * N / 4 + 1, mySourceRow)][globalToLocal(3 * N / 4 + 1, mySourceCol)] = 1.0;
+   }
+
+   if (inMyGrid(N / 4 + 1, 3 * N / 4 + 1, mySourceRow, mySourceRowSize, mySourceCol, mySourceColSize)) {
+      //A[N/4+1][3*N/4+1] = -1.0;
+      X[globalToLocal(N / 4 + 1, mySourceRow)][globalToLocal(3 * N / 4 + 1, mySourceCol)] = -1.0;
+   }
+
+   if (inMyGrid(3 * N / 4 + 1, N / 4 + 1, mySourceRow, mySourceRowSize, mySourceCol, mySourceColSize)) {
+      //[3*N/4+1][N/4+1] = -1.0;
+      X[globalToLocal(3 * N / 4 + 1, mySourceRow)][globalToLocal(N / 4 + 1, mySourceCol)] = -1.0;
+   }
+}
+
+// rows [lo, hi): Y = S X, returning the largest change
+static inline double sweepBlockRows(Block *pBlock, int64_t lo, int64_t hi) {
+   double localEpsilon = 0.0;
+   for (int64_t i = lo; i < hi; ++i) {
+      double le = pBlock->pfnRow(pBlock->X[i-1], pBlock->X[i], pBlock->X[i+1], pBlock->Y[i], pBlock->mySourceColSize);
+      if (le > localEpsilon) {
+         localEpsilon = le;
+      }
+   }
+   return localEpsilon;
+}
+
+DEFINE_PARALLEL_REDUCE(parallelSweep, Block, 0.0, sweepBlockRows, parallelMax)
+
+// rows [lo, hi), columns 2..mySourceColSize-1: the points a sweep can do
+// without the halo (given rows 2..mySourceRowSize-1)
+static inline double sweepBlockInterior(Block *pBlock, int64_t lo, int64_t hi) {
+   double localEpsilon = 0.0;
+   for (int64_t i = lo; i < hi; ++i) {
+      double le = pBlock->pfnRow(&pBlock->X[i-1][1], &pBlock->X[i][1], &pBlock->X[i+1][1], &pBlock->Y[i][1], pBlock->mySourceColSize - 2);
+      if (le > localEpsilon) {
+         localEpsilon = le;
+      }
+   }
+   return localEpsilon;
+}
+
+DEFINE_PARALLEL_REDUCE(parallelSweepInterior, Block, 0.0, sweepBlockInterior, parallelMax)
+
+// The rest of the sweep once the halo is in: the first and last rows, and
+// the first and last columns of the rows between
+static inline double sweepBlockFrame(Block *pBlock) {
+   int64_t rows = pBlock->mySourceRowSize;
+   int64_t cols = pBlock->mySourceColSize;
+   double localEpsilon = sweepBlockRows(pBlock, 1, 2);
+   if (rows > 1) {
+      double le = sweepBlockRows(pBlock, rows, rows + 1);
+      if (le > localEpsilon) {
+         localEpsilon = le;
+      }
+   }
+   for (int64_t i = 2; i < rows; ++i) {
+      for (int64_t j = 1; j <= cols; j += cols > 1 ? cols - 1 : 1) {
+         double le = pBlock->pfnRow(&pBlock->X[i-1][j-1], &pBlock->X[i][j-1], &pBlock->X[i+1][j-1], &pBlock->Y[i][j-1], 1);
+         if (le > localEpsilon) {
+            localEpsilon = le;
+         }
+      }
+   }
+   return localEpsilon;
+}
+
+// rows [lo, hi), columns ghostColLo to ghostColLo + ghostCols - 1: a sweep
+// reaching into the halo.  The row kernels give a point the same bits
+// wherever the row starts, so the neighbours' points recomputed here are
+// theirs exactly, and --ghost K the same as K = 1.
+static inline double sweepBlockGhostRows(Block *pBlock, int64_t lo, int64_t hi) {
+   double localEpsilon = 0.0;
+   int64_t j = pBlock->ghostColLo - 1;
+   for (int64_t i = lo; i < hi; ++i) {
+      double le = pBlock->pfnRow(&pBlock->X[i-1][j], &pBlock->X[i][j], &pBlock->X[i+1][j], &pBlock->Y[i][j], pBlock->ghostCols);
+      if (le > localEpsilon) {
+         localEpsilon = le;
+      }
+   }
+   return localEpsilon;
+}
+
+DEFINE_PARALLEL_REDUCE(parallelSweepGhost, Block, 0.0, sweepBlockGhostRows, parallelMax)
+
+// A sweep of the block and the cDepth rows and columns of halo round it
+// whose inputs are still good, i.e. the neighbours' points the next
+// cDepth sweeps need, computed here again instead of exchanged.  Past the
+// edge of the global grid the halo is the fixed boundary, and isn't swept.
+// The neighbours' points move as much as they do on their own ranks, so
+// counting them leaves the global delta as it was.
+static inline double sweepBlockGhost(Block *pBlock, int64_t cDepth) {
+   int64_t up = MPI_PROC_NULL == pBlock->aNeighbours[HALO_UP] ? 0 : cDepth;
+   int64_t down = MPI_PROC_NULL == pBlock->aNeighbours[HALO_DOWN] ? 0 : cDepth;
+   int64_t left = MPI_PROC_NULL == pBlock->aNeighbours[HALO_LEFT] ? 0 : cDepth;
+   int64_t right = MPI_PROC_NULL == pBlock->aNeighbours[HALO_RIGHT] ? 0 : cDepth;
+   pBlock->ghostColLo = 1 - left;
+   pBlock->ghostCols = pBlock->mySourceColSize + left + right;
+   return parallelSweepGhost(pBlock->pPool, 1 - up, pBlock->mySourceRowSize + 1 + down, pBlock);
+}
+
+// After a sweep: Y is the new X, and X is free to be the next Y
+static inline void swapBlock(Block *pBlock) {
+   double **temp = pBlock->X;
+   pBlock->X = pBlock->Y;
+   pBlock->Y = temp;
+
+   Halo halo = pBlock->halo;
+   pBlock->halo = pBlock->haloY;
+   pBlock->haloY = halo;
+}
+
+// the fp32 versions of the above
+static inline double sweepBlockRowsF(Block *pBlock, int64_t lo, int64_t hi) {
+   double localEpsilon = 0.0;
+   for (int64_t i = lo; i < hi; ++i) {
+      double le = pBlock->pfnRowF(pBlock->XF[i-1], pBlock->XF[i], pBlock->XF[i+1], pBlock->YF[i], pBlock->mySourceColSize);
+      if (le > localEpsilon) {
+         localEpsilon = le;
+      }
+   }
+   return localEpsilon;
+}
+
+DEFINE_PARALLEL_REDUCE(parallelSweepF, Block, 0.0, sweepBlockRowsF, parallelMax)
+
+static inline void swapBlockF(Block *pBlock) {
+   float **temp = pBlock->XF;
+   pBlock->XF = pBlock->YF;
+   pBlock->YF = temp;
+
+   Halo halo = pBlock->haloF;
+   pBlock->haloF = pBlock->haloFY;
+   pBlock->haloFY = halo;
+}
+
+// rows [lo, hi) of X narrowed into XF, halo columns included
+static inline void toFloatBlockRows(Block *pBlock, int64_t lo, int64_t hi) {
+   for (int64_t i = lo; i < hi; ++i) {
+      for (int64_t j = 0; j < pBlock->mySourceColSize + 2; ++j) {
+         pBlock->XF[i][j] = (float)pBlock->X[i][j];
+      }
+   }
+}
+
+DEFINE_PARALLEL_FOR(parallelToFloat, Block, toFloatBlockRows)
+
+// rows [lo, hi) of XF widened into X
+static inline void toDoubleBlockRows(Block *pBlock, int64_t lo, int64_t hi) {
+   for (int64_t i = lo; i < hi; ++i) {
+      for (int64_t j = 0; j < pBlock->mySourceColSize + 2; ++j) {
+         pBlock->X[i][j] = pBlock->XF[i][j];
+      }
+   }
+}
+
+DEFINE_PARALLEL_FOR(parallelToDouble, Block, toDoubleBlockRows)
+
+// the colour's rows [lo, hi) -- local row colourRow + 2 k for each k --
+// updated in place
+static inline double colourBlockRows(Block *pBlock, int64_t lo, int64_t hi) {
+   double localEpsilon = 0.0;
+   for (int64_t k = lo; k < hi; ++k) {
+      int64_t i = pBlock->colourRow + 2 * k;
+      double le = stencil9RowColour(pBlock->X[i-1], pBlock->X[i], pBlock->X[i+1], pBlock->mySourceColSize, pBlock->colourCol);
+      if (le > localEpsilon) {
+         localEpsilon = le;
+      }
+   }
+   return localEpsilon;
+}
+
+DEFINE_PARALLEL_REDUCE(parallelColour, Block, 0.0, colourBlockRows, parallelMax)
+
+// entries [lo, hi) of the active tile list
+static inline double activeBlockTiles(Block *pBlock, int64_t lo, int64_t hi) {
+   double localEpsilon = 0.0;
+   for (int64_t k = lo; k < hi; ++k) {
+      double le = runActiveTile(pBlock->pTiles, k, pBlock->pfnRow, pBlock->X, pBlock->Y);
+      if (le > localEpsilon) {
+         localEpsilon = le;
+      }
+   }
+   return localEpsilon;
+}
+
+DEFINE_PARALLEL_REDUCE(parallelActiveTiles, Block, 0.0, activeBlockTiles, parallelMax)
+
+// Whether the ranks stop after their iteration-th sweep (from 1), which
+// moved this rank's points by up to localEpsilon.  All ranks come to the
+// same answer on the same sweep.
+bool checkConvergence(Block *pBlock, double localEpsilon, int iteration) {
+   double tStart = MPI_Wtime();
+   bool fConverged = false;
+
+   switch (pBlock->convergence) {
+   case CONVERGENCE_LAGGED:
+      // act on the last sweep's delta, and start on this one's
+      if (pBlock->fReducing) {
+         MPI_Wait(&pBlock->reduceRequest, MPI_STATUS_IGNORE);
+         pBlock->fReducing = false;
+         fConverged = pBlock->globalEpsilon <= pBlock->tolerance;
+      }
+      if (fConverged) {
+         pBlock->cLate += 1;
+      }
+      else {
+         pBlock->sentEpsilon = localEpsilon;
+         MPI_Iallreduce(&pBlock->sentEpsilon, &pBlock->globalEpsilon, 1, MPI_DOUBLE, MPI_MAX, pBlock->comm, &pBlock->reduceRequest);
+         pBlock->fReducing = true;
+         ++pBlock->cChecks;
+      }
+      break;
+
+   case CONVERGENCE_EVERY:
+      if (iteration >= pBlock->nextCheck) {
+         MPI_Allreduce(&localEpsilon, &pBlock->globalEpsilon, 1, MPI_DOUBLE, MPI_MAX, pBlock->comm);
+         ++pBlock->cChecks;
+         fConverged = pBlock->globalEpsilon <= pBlock->tolerance;
+
+         // the sweeps since the last check may all have been needed, or all
+         // but the first of them
+         int64_t cSince = iteration - pBlock->lastCheck;
+         if (fConverged) {
+            pBlock->cLate += cSince - 1;
+         }
+         else {
+            // at the rate delta fell since the last check, half the sweeps
+            // it still has to go -- bounded by cMaxEvery
+            int64_t cNext = pBlock->cMaxEvery;
+            if (pBlock->lastEpsilon > pBlock->globalEpsilon && pBlock->globalEpsilon > 0.0) {
+               double rate = log(pBlock->globalEpsilon / pBlock->lastEpsilon) / cSince;
+               double cToGo = log(pBlock->tolerance / pBlock->globalEpsilon) / rate;
+               if (cToGo / 2 < cNext) {
+                  cNext = cToGo / 2 < 1 ? 1 : (int64_t)(cToGo / 2);
+               }
+            }
+            pBlock->lastCheck = iteration;
+            pBlock->lastEpsilon = pBlock->globalEpsilon;
+            pBlock->nextCheck = iteration + cNext;
+         }
+      }
+      break;
+
+   default:
+      MPI_Allreduce(&localEpsilon, &pBlock->globalEpsilon, 1, MPI_DOUBLE, MPI_MAX, pBlock->comm);
+      ++pBlock->cChecks;
+      fConverged = pBlock->globalEpsilon <= pBlock->tolerance;
+      break;
+   }
+
+   pBlock->tReduce += MPI_Wtime() - tStart;
+   return fConverged;
+}
+
+// Start iterate's or iterateF's convergence checks afresh
+void resetConvergence(Block *pBlock) {
+   pBlock->fReducing = false;
+   pBlock->nextCheck = 1;
+   pBlock->lastCheck = 0;
+   pBlock->lastEpsilon = 0.0;
+}
+
+// Sweep X (using Y) until no point moves by more than tolerance, the halo
+// coming from the neighbouring ranks: in place by colour with fColour,
+// only the active tiles with pTiles, cGhost sweeps to an exchange with a
+// deeper halo.  Returns the number of sweeps; the
+// result is in pBlock->X.
+int iterate(Block *pBlock) {
+   int64_t mySourceRowSize = pBlock->mySourceRowSize;
+   int64_t mySourceColSize = pBlock->mySourceColSize;
+   double localEpsilon;
+   int iterations = 0;
+   resetConvergence(pBlock);
+   do {
+      /* TODO (step 6): Implement the 9-point stencil using ISend/IRecv
+         and Wait routines.  Use the non-blocking routines in order to get
+         all the communication up and running in a safe manner.  While it
+         is possible to compute on the innermost elements of the array
+         before the communication completes, there is no reason to do so
+         -- simply use the non-blocking calls as a means of getting a
+         number of communications up and running without waiting for
+         others to complete. */
+
+
+
+      if (!pBlock->fColour && !pBlock->fOverlap && iterations % pBlock->cGhost == 0) {
+         exchangeHalos(pBlock, &pBlock->halo);
+      }
+
+      // Now compute the stencil, and how far each row (or active tile) moved
+      // (less whatever exchanges happen in between, which time themselves)
+      localEpsilon = 0.0;
+      double tComm = pBlock->tHalo + pBlock->tWait;
+      double tStart = MPI_Wtime();
+      if (pBlock->fOverlap) {
+         // the interior while the halo is in flight, then the frame (bit
+         // for bit the plain sweep: the row kernels round a point the same
+         // whatever column the row starts at)
+         startHalos(pBlock, &pBlock->halo);
+         if (mySourceColSize > 2) {
+            localEpsilon = parallelSweepInterior(pBlock->pPool, 2, mySourceRowSize, pBlock);
+         }
+         finishHalos(pBlock, &pBlock->halo);
+         double le = sweepBlockFrame(pBlock);
+         if (le > localEpsilon) {
+            localEpsilon = le;
+         }
+      }
+      else if (pBlock->fColour) {
+         // colour by colour in place, each with the halo as of the last
+         for (int c = 0; c < STENCIL_COLOURS; ++c) {
+            exchangeHalos(pBlock, &pBlock->halo);
+            pBlock->colourRow = stencilColourFirst(c / 2, pBlock->mySourceRow);
+            pBlock->colourCol = stencilColourFirst(c % 2, pBlock->mySourceCol);
+            double le = parallelColour(pBlock->pPool, 0, (mySourceRowSize - pBlock->colourRow + 2) / 2, pBlock);
+            if (le > localEpsilon) {
+               localEpsilon = le;
+            }
+         }
+      }
+      else if (NULL != pBlock->pTiles) {
+         trackHalo(pBlock->X, mySourceRowSize, mySourceColSize, pBlock->aHalo, pBlock->pTiles);
+         planActiveTiles(pBlock->pTiles);
+         localEpsilon = parallelActiveTiles(pBlock->pPool, 0, pBlock->pTiles->cList, pBlock);
+      }
+      else if (pBlock->cGhost > 1) {
+         // the halo is good cGhost - 1 deep after the exchange, one less
+         // after each sweep
+         localEpsilon = sweepBlockGhost(pBlock, pBlock->cGhost - 1 - iterations % pBlock->cGhost);
+      }
+      else {
+         localEpsilon = parallelSweep(pBlock->pPool, 1, mySourceRowSize + 1, pBlock);
+      }
+      pBlock->tCompute += MPI_Wtime() - tStart - (pBlock->tHalo + pBlock->tWait - tComm);
+
+      //outputArray(Y,myProcID,myRow,myCol,mySourceRowSize,mySourceColSize,numRows,numCols,numProcs,comm);
+
+
+      /* TODO (step 7): Verify that the stencil seems to be progressing
+         correctly, as in assignment #5. */
+
+      //Done!
+
+
+      /* TODO (step 8): Use an MPI reduction to compute the termination of
+         the routine, as in assignment #5. */
+      // (localEpsilon came out of the stencil sweep above; see
+      // checkConvergence)
+
+      // Y is the new X (the skipped active tiles having been brought up to
+      // date in it)
+      if (!pBlock->fColour) {
+         swapBlock(pBlock);
+      }
+
+      ++iterations;
+   }
+   while (!checkConvergence(pBlock, localEpsilon, iterations));
+
+   return iterations;
+}
+
+// The plain sweeps of iterate on XF and YF, ending up in XF.  The deltas
+// are still reduced as doubles.
+int iterateF(Block *pBlock) {
+   double localEpsilon;
+   int iterations = 0;
+   resetConvergence(pBlock);
+   do {
+      exchangeHalos(pBlock, &pBlock->haloF);
+
+      double tStart = MPI_Wtime();
+      localEpsilon = parallelSweepF(pBlock->pPool, 1, pBlock->mySourceRowSize + 1, pBlock);
+      pBlock->tCompute += MPI_Wtime() - tStart;
+
+      swapBlockF(pBlock);
+
+      ++iterations;
+   }
+   while (!checkConvergence(pBlock, localEpsilon, iterations));
+
+   return iterations;
+}
+
+// pGrid's rows as a block with a halo cGhost deep sees them: X[i][j] for i
+// and j from 1 - cGhost, its own points starting at X[1][1].  Shifts the
+// grid's aRows in place.
+double **ghostRows(Grid *pGrid, int64_t cGhost) {
+   for (int64_t i = 0; i < pGrid->cRows + 2; ++i) {
+      pGrid->aRows[i] += cGhost - 1;
+   }
+   return pGrid->aRows + cGhost - 1;
+}
+
+// Run by each pool thread once, not per range
+static void *flushDenormalsWorker(void *ptr) {
+   (void)ptr;
+   stencilFlushDenormals();
+   return NULL;
+}
+
+static void *restoreDenormalsWorker(void *ptr) {
+   (void)ptr;
+   stencilRestoreDenormals();
+   return NULL;
+}
+
+// The largest difference between pBlock's points in X and in R
+double blockError(Block *pBlock, double **R) {
+   double localError = 0.0;
+   for (int64_t i = 1; i <= pBlock->mySourceRowSize; ++i) {
+      for (int64_t j = 1; j <= pBlock->mySourceColSize; ++j) {
+         double temp = fabs(pBlock->X[i][j] - R[i][j]);
+         if (temp > localError) {
+            localError = temp;
+         }
+      }
+   }
+   return localError;
+}
+
 int main(int argc, char *argv[]) {
    int numProcs, myProcID;
    int numRows, numCols;
    int myRow, myCol;
-   MPI_Status status;
 
    //
-   // Boilerplate MPI startup -- query # processes/images and my unique ID
+   // Boilerplate MPI startup -- query # processes/images and my unique ID.
+   // Only the main thread makes MPI calls; --threads workers just sweep.
    //
-   MPI_Init(&argc, &argv);
+   int provided;
+   MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
    MPI_Comm_size(MPI_COMM_WORLD, &numProcs);
    MPI_Comm_rank(MPI_COMM_WORLD, &myProcID);
 
+   //
+   // stencil9-mpi [--threads T] [--kernel auto|scalar|avx2|avx512]
+   //              [--active off|exact|epsilon] [--tile ROWS] [--tile-cols COLS]
+   //              [--update jacobi|colour] [--precision fp64|fp32|fp32-refine]
+   //              [--overlap off|on] [--convergence sync|lagged|every] [--every K]
+   //              [--ghost K]
+   // --threads runs each rank's sweeps and copies on T threads (see
+   // ParallelFor.h), for fewer, fatter ranks: fewer halos and fewer
+   // processes in each Allreduce.  The row kernel from Stencil.h, the
+   // widest this cpu runs by default.
+   // --active only sweeps the local tiles that changed, or are next to one
+   // that did (see ActiveTiles.h); changes in the halo count too.
+   // --update colour updates X in place, one colour of the global grid at a
+   // time with a halo exchange before each, and needs no Y.  --precision
+   // fp32 sweeps (and exchanges) fp32 copies of X and Y, fp32-refine stops
+   // them at the looser epsilonF and goes on in fp64; both report the error
+   // against as many plain fp64 sweeps.  --overlap on sweeps the points that don't
+   // need the halo while it's in flight, and the frame round them once it's
+   // in.  Rank 0 reports the time per iteration each rank spent sweeping,
+   // on the halo, waiting for it and in the Allreduce (the most any rank
+   // did).  --convergence lagged overlaps each sweep's Allreduce with the
+   // next sweep, and stops a sweep late; every reduces only every K sweeps
+   // (at most --every, fewer as delta closes in on epsilon).  Both print
+   // how many sweeps they may have run past convergence.  --ghost K
+   // exchanges a halo K deep, corners included, every K sweeps instead of
+   // one cell deep every sweep: the sweeps in between also redo the
+   // neighbours' points the next ones need, a cell less deep each time.
+   // K messages' latency for a little more compute; make run-ghost finds
+   // the best K.
+   //
+   int64_t cThreads = 1;
+   STENCIL_KERNEL kernel = STENCIL_AUTO;
+   const char *pszActive = "off";
+   int64_t cTileRows = 32;
+   int64_t cTileCols = N;
+   const char *pszUpdate = "jacobi";
+   const char *pszPrecision = "fp64";
+   const char *pszOverlap = "off";
+   const char *pszConvergence = "sync";
+   int64_t cMaxEvery = 16;
+   int64_t cGhost = 1;
+   int arg;
+   for (arg = 1; arg + 1 < argc; arg += 2) {
+      if (0 == strcmp(argv[arg], "--threads")) {
+         cThreads = atol(argv[arg + 1]);
+      }
+      else if (0 == strcmp(argv[arg], "--kernel")) {
+         kernel = parseStencilKernel(argv[arg + 1]);
+      }
+      else if (0 == strcmp(argv[arg], "--active")) {
+         pszActive = argv[arg + 1];
+      }
+      else if (0 == strcmp(argv[arg], "--tile")) {
+         cTileRows = atol(argv[arg + 1]);
+      }
+      else if (0 == strcmp(argv[arg], "--tile-cols")) {
+         cTileCols = atol(argv[arg + 1]);
+      }
+      else if (0 == strcmp(argv[arg], "--update")) {
+         pszUpdate = argv[arg + 1];
+      }
+      else if (0 == strcmp(argv[arg], "--precision")) {
+         pszPrecision = argv[arg + 1];
+      }
+      else if (0 == strcmp(argv[arg], "--overlap")) {
+         pszOverlap = argv[arg + 1];
+      }
+      else if (0 == strcmp(argv[arg], "--convergence")) {
+         pszConvergence = argv[arg + 1];
+      }
+      else if (0 == strcmp(argv[arg], "--every")) {
+         cMaxEvery = atol(argv[arg + 1]);
+      }
+      else if (0 == strcmp(argv[arg], "--ghost")) {
+         cGhost = atol(argv[arg + 1]);
+      }
+      else {
+         break;
+      }
+   }
+
+   bool fActive = 0 != strcmp(pszActive, "off");
+   double threshold = 0 == strcmp(pszActive, "epsilon") ? epsilon : 0.0;
+   bool fColour = 0 == strcmp(pszUpdate, "colour");
+   bool fFloat = 0 != strcmp(pszPrecision, "fp64");
+   bool fRefine = 0 == strcmp(pszPrecision, "fp32-refine");
+   bool fOverlap = 0 == strcmp(pszOverlap, "on");
+   CONVERGENCE convergence = 0 == strcmp(pszConvergence, "sync") ? CONVERGENCE_SYNC :
+                             0 == strcmp(pszConvergence, "lagged") ? CONVERGENCE_LAGGED :
+                             0 == strcmp(pszConvergence, "every") ? CONVERGENCE_EVERY : CONVERGENCE_COUNT;
+   if (arg < argc || cThreads < 1 || cTileRows < 1 || cTileCols < 1 ||
+       (fActive && 0 != strcmp(pszActive, "exact") && 0 != strcmp(pszActive, "epsilon")) ||
+       (!fColour && 0 != strcmp(pszUpdate, "jacobi")) || (fColour && fActive) ||
+       (fFloat && !fRefine && 0 != strcmp(pszPrecision, "fp32")) || (fFloat && (fActive || fColour)) ||
+       (!fOverlap && 0 != strcmp(pszOverlap, "off")) || (fOverlap && (fActive || fColour || fFloat)) ||
+       convergence == CONVERGENCE_COUNT || cMaxEvery < 1 ||
+       cGhost < 1 || (cGhost > 1 && (fActive || fColour || fFloat || fOverlap))) {
+      kernel = STENCIL_COUNT;
+   }
+
+   PFN_STENCIL9_ROW pfnRow = kernel == STENCIL_COUNT ? NULL : selectStencil9Row(&kernel);
+   if (NULL == pfnRow) {
+      if (myProcID == 0) {
+         printf("Usage: stencil9-mpi [--threads T] [--kernel auto|scalar|avx2|avx512]\n"
+                "                    [--active off|exact|epsilon] [--tile ROWS] [--tile-cols COLS]\n"
+                "                    [--update jacobi|colour] [--precision fp64|fp32|fp32-refine]\n"
+                "                    [--overlap off|on] [--convergence sync|lagged|every] [--every K]\n"
+                "                    [--ghost K]\n"
+                "--active, --update colour, fp32, --overlap and --ghost over 1 don't go together\n");
+      }
+      MPI_Finalize();
+      return 1;
+   }
+
+   if (provided < MPI_THREAD_FUNNELED && cThreads > 1 && myProcID == 0) {
+      printf("Warning: this MPI doesn't promise MPI_THREAD_FUNNELED\n");
+   }
+
+   ParallelPool pool;
+   if (0 != createParallelPool(cThreads, &pool)) {
+      MPI_Abort(MPI_COMM_WORLD, 1);
+   }
+
    //
    // Arrange the numProcs processes into a virtual 2D grid (numRows x
    // numCols) and compute my logical position within it (myRow,
    // myCol).
+   // MPI_Cart_create may renumber the processes to suit the machine, so
+   // from here on the rank in gridComm is the one that counts.
    //
    computeGridSize(numProcs, &numRows, &numCols);
-   computeGridPos(myProcID, numRows, numCols, &myRow, &myCol);
+   int dims[2] = { numRows, numCols };
+   int periods[2] = { 0, 0 };
+   int coords[2];
+   MPI_Comm gridComm;
+   MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 1, &gridComm);
+   MPI_Comm_rank(gridComm, &myProcID);
+   MPI_Cart_coords(gridComm, myProcID, 2, coords);
+   myRow = coords[0];
+   myCol = coords[1];
+
+   // a halo can't be deeper than the smallest block it comes from
+   if (cGhost > N / numRows || cGhost > N / numCols) {
+      if (myProcID == 0) {
+         printf("--ghost %lld is deeper than the smallest block, %d x %d\n", (long long)cGhost, N / numRows, N / numCols);
+      }
+      MPI_Finalize();
+      return 1;
+   }
 
    //
    // Sanity check that we're up and running correctly.  Feel free to
@@ -358,28 +1118,27 @@ int main(int argc, char *argv[]) {
       cells for caching neighboring processors' values, similar to what
       was shown for the 1D 3-point stencil in class, simply in 2D. */
 
-   //printf("Process %d: Allocating X\n",myProcID);
-   double **X; // the X array
-   X = (double **)malloc(sizeof(double *) * (mySourceRowSize + 2));
-   for (int i = 0; i < mySourceRowSize + 2; ++i) {
-      X[i] = (double *)malloc(sizeof(double) * (mySourceColSize + 2));
-   }
-
-   //printf("Process %d: Allocating Y\n",myProcID);
-   double **Y; // the Y array
-   Y = (double **)malloc(sizeof(double *) * (mySourceRowSize + 2));
-   for (int i = 0; i < mySourceRowSize + 2; ++i) {
-      Y[i] = (double *)malloc(sizeof(double) * (mySourceColSize + 2));
+   // Each array is one aligned block with padded rows (see Grid.h), so
+   // the rows stream one after the other and a column is a strided type.
+   // With --ghost the halo is cGhost deep: Grid.h's own one-element halo
+   // plus cGhost - 1 more rows and columns all round.
+   //printf("Process %d: Allocating X and Y\n",myProcID);
+   Grid gridX;
+   Grid gridY = { 0 }; // the Y array, not needed when updating in place
+   if (0 != createGrid(mySourceRowSize + 2 * (cGhost - 1), mySourceColSize + 2 * (cGhost - 1), false, &gridX) ||
+       (!fColour && 0 != createGrid(mySourceRowSize + 2 * (cGhost - 1), mySourceColSize + 2 * (cGhost - 1), false, &gridY))) {
+      MPI_Abort(MPI_COMM_WORLD, 1);
    }
 
    /* TODO (step 3): Initialize the arrays to zero. */
    // printf("Process %d: Initializing Arrays to ZERO\n",myProcID);
-   for (int i = 0; i < mySourceRowSize + 2; ++i) {
-      for (int j = 0; j < mySourceColSize + 2; ++j) {
-         X[i][j] = 0.0;
-         Y[i][j] = 0.0;
-      }
+   // (by the threads that will sweep the rows, which places the pages)
+   parallelClear(&pool, 0, gridX.cRows + 2, &gridX);
+   if (!fColour) {
+      parallelClear(&pool, 0, gridY.cRows + 2, &gridY);
    }
+   double **X = ghostRows(&gridX, cGhost);
+   double **Y = fColour ? NULL : ghostRows(&gridY, cGhost);
 
    /* TODO (step 4): Initialize the arrays to contain four +/-1.0
       values, as in assignment #5.  Note that you will need to do a
@@ -391,25 +1150,7 @@ int main(int argc, char *argv[]) {
    // Place a nonzero entry in the center of each quadrant.
    //
 
-   if (inMyGrid(N / 4 + 1, N / 4 + 1, mySourceRow, mySourceRowSize, mySourceCol, mySourceColSize))  {
-      //A[N/4+1][N/4+1] = 1.0;
-      X[globalToLocal(N / 4 + 1, mySourceRow)][globalToLocal(N / 4 + 1, mySourceCol)] = 1.0;
-   }
-
-   if (inMyGrid(3 * N / 4 + 1, 3 * N / 4 + 1, mySourceRow, mySourceRowSize, mySourceCol, mySourceColSize)) {
-      //A[3*N/4+1][3*N/4+1] = 1.0;
-      X[globalToLocal(3 * N / 4 + 1, mySourceRow)][globalToLocal(3 * N / 4 + 1, mySourceCol)] = 1.0;
-   }
-
-   if (inMyGrid(N / 4 + 1, 3 * N / 4 + 1, mySourceRow, mySourceRowSize, mySourceCol, mySourceColSize)) {
-      //A[N/4+1][3*N/4+1] = -1.0;
-      X[globalToLocal(N / 4 + 1, mySourceRow)][globalToLocal(3 * N / 4 + 1, mySourceCol)] = -1.0;
-   }
-
-   if (inMyGrid(3 * N / 4 + 1, N / 4 + 1, mySourceRow, mySourceRowSize, mySourceCol, mySourceColSize)) {
-      //[3*N/4+1][N/4+1] = -1.0;
-      X[globalToLocal(3 * N / 4 + 1, mySourceRow)][globalToLocal(N / 4 + 1, mySourceCol)] = -1.0;
-   }
+   placeSeeds(X, mySourceRow, mySourceRowSize, mySourceCol, mySourceColSize);
 
    /* TODO (step 5): Implement a routine to sequentially print out the
       distributed array to the console in a coordinated manner such
@@ -421,198 +1162,135 @@ int main(int argc, char *argv[]) {
       routine to verify that your initialization is correct.
    */
 
-   int buffer = 0;
-   fflush(stdout);
-
-   // testArray(X, mySourceRow,mySourceRowSize,mySourceCol,mySourceColSize,numRows,numCols);
-
-   //outputArray(X, myProcID, myRow, myCol, mySourceRowSize, mySourceColSize, numRows, numCols, numProcs);
-
-   double globalEpsilon = 0.0;
-   int iterations = 0;
-   do {
-      /* TODO (step 6): Implement the 9-point stencil using ISend/IRecv
-         and Wait routines.  Use the non-blocking routines in order to get
-         all the communication up and running in a safe manner.  While it
-         is possible to compute on the innermost elements of the array
-         before the communication completes, there is no reason to do so
-         -- simply use the non-blocking calls as a means of getting a
-         number of communications up and running without waiting for
-         others to complete. */
-
-
-
-      int procUpID = getUpID(myProcID, numCols);
-      MPI_Request upSendRequest;
-      MPI_Request upRecvRequest;
-      int procDownID = getDownID(myProcID, numProcs, numCols);
-      MPI_Request downSendRequest;
-      MPI_Request downRecvRequest;
-
-
-      // Up & Down
-      //printf("Process %d: procUpID = %d procDownID = %d\n", myProcID, procUpID, procDownID);
-      if (procUpID >= 0) {
-         MPI_Isend(&X[1][1], mySourceColSize, MPI_DOUBLE, procUpID, MESSAGE_SEND_TOP, MPI_COMM_WORLD, &upSendRequest);
-         MPI_Irecv(&X[0][1], mySourceColSize, MPI_DOUBLE, procUpID, MESSAGE_SEND_BOTTOM, MPI_COMM_WORLD, &upRecvRequest);
-      }
-
-      if (procDownID >= 0) {
-         MPI_Isend(&X[mySourceRowSize][1], mySourceColSize, MPI_DOUBLE, procDownID, MESSAGE_SEND_BOTTOM, MPI_COMM_WORLD, &downSendRequest);
-         MPI_Irecv(&X[mySourceRowSize + 1][1], mySourceColSize, MPI_DOUBLE, procDownID, MESSAGE_SEND_TOP, MPI_COMM_WORLD, &downRecvRequest);
-      }
-
-      if (procUpID >= 0) {
-         MPI_Wait(&upSendRequest, &status);
-         MPI_Wait(&upRecvRequest, &status);
-      }
-
-      if (procDownID >= 0) {
-         MPI_Wait(&downSendRequest, &status);
-         MPI_Wait(&downRecvRequest, &status);
-      }
-
-      // Left & Right
-
-      int procLeftID = getLeftID(myProcID, numCols);
-      int procRightID = getRightID(myProcID, numProcs, numCols);
-      //printf("Process %d: LeftID = %d rightID = %d\n", myProcID, procLeftID, procRightID);
-      MPI_Request leftSendRequest;
-      MPI_Request leftRecvRequest;
-      MPI_Request rightSendRequest;
-      MPI_Request rightRecvRequest;
-
-      for (int i = 1; i < mySourceRowSize + 2; ++i) {
-         if (procLeftID >= 0) {
-            MPI_Isend(&X[i][1], 1, MPI_DOUBLE, procLeftID, MESSAGE_SEND_LEFT, MPI_COMM_WORLD, &leftSendRequest);
-            MPI_Irecv(&X[i][0], 1, MPI_DOUBLE, procLeftID, MESSAGE_SEND_RIGHT, MPI_COMM_WORLD, &leftRecvRequest);
-         }
-
-         if (procRightID >= 0) {
-            MPI_Isend(&X[i][mySourceColSize], 1, MPI_DOUBLE, procRightID, MESSAGE_SEND_RIGHT, MPI_COMM_WORLD, &rightSendRequest);
-            MPI_Irecv(&X[i][mySourceColSize + 1], 1, MPI_DOUBLE, procRightID, MESSAGE_SEND_LEFT, MPI_COMM_WORLD, &rightRecvRequest);
-         }
-
-         if (procLeftID >= 0) {
-            MPI_Wait(&leftSendRequest, &status);
-            MPI_Wait(&leftRecvRequest, &status);
-         }
-
-         if (procRightID >= 0) {
-            MPI_Wait(&rightSendRequest, &status);
-            MPI_Wait(&rightRecvRequest, &status);
-         }
+   // the halo as of the last step, all zero to begin with like X's
+   ActiveTiles tiles;
+   double *aHalo = NULL;
+   if (fActive) {
+      aHalo = calloc(2 * (mySourceColSize + 2) + 2 * mySourceRowSize, sizeof(double));
+      if (NULL == aHalo || 0 != createActiveTiles(mySourceRowSize, mySourceColSize, cTileRows, cTileCols, threshold, &tiles)) {
+         printf("Process %d: out of memory allocating the active tiles!\n", myProcID);
+         MPI_Abort(MPI_COMM_WORLD, 1);
       }
+   }
 
-      // Down Left & Up Right Down Right & Up Left
-      int procDownLeftID = getDownLeftID(myProcID, numProcs, numCols);
-      int procDownRightID = getDownRightID(myProcID, numProcs, numCols);
-      int procUpLeftID   = getUpLeftID(myProcID, numCols);
-      int procUpRightID  = getUpRightID(myProcID, numProcs, numCols);
+   fflush(stdout);
 
-      //printf("Process %d: Down Left: %d Down Right: %d up Left = %d Up Right = %d\n", myProcID, procDownLeftID, procDownRightID, procUpLeftID, procUpRightID);
-      MPI_Request downLeftSendRequest;
-      MPI_Request downLeftRecvRequest;
-      MPI_Request upLeftSendRequest;
-      MPI_Request upLeftRecvRequest;
-      MPI_Request downRightSendRequest;
-      MPI_Request downRightRecvRequest;
-      MPI_Request upRightSendRequest;
-      MPI_Request upRightRecvRequest;
+   // testArray(X, mySourceRow,mySourceRowSize,mySourceCol,mySourceColSize,numRows,numCols);
 
-      if (procDownLeftID >= 0) {
-         //printf("Process: %d, send/recv down left\n", myProcID);
-         MPI_Isend(&X[mySourceRowSize][1], 1, MPI_DOUBLE, procDownLeftID, MESSAGE_SEND_DOWN_LEFT, MPI_COMM_WORLD, &downLeftSendRequest);
-         MPI_Irecv(&X[mySourceRowSize + 1][0], 1, MPI_DOUBLE, procDownLeftID, MESSAGE_SEND_UP_RIGHT, MPI_COMM_WORLD, &downLeftRecvRequest);
-      }
+   //outputArray(X, myProcID, myRow, myCol, mySourceRowSize, mySourceColSize, numRows, numCols, numProcs, gridComm);
+
+   Block block = {
+      .mySourceRow = mySourceRow,
+      .mySourceRowSize = mySourceRowSize,
+      .mySourceCol = mySourceCol,
+      .mySourceColSize = mySourceColSize,
+      .myProcID = myProcID,
+      .comm = gridComm,
+      .pPool = &pool,
+      .X = X,
+      .Y = Y,
+      .pfnRow = pfnRow,
+      .pfnRowF = selectStencil9RowF(kernel),
+      .pTiles = fActive ? &tiles : NULL,
+      .aHalo = aHalo,
+      .fColour = fColour,
+      .fOverlap = fOverlap,
+      .cGhost = cGhost,
+      .convergence = convergence,
+      .cMaxEvery = cMaxEvery,
+      .tolerance = epsilon,
+   };
+
+   // the neighbours and the exchanges, once for the whole run
+   int aOffsets[HALO_COUNT][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 }, { 1, -1 }, { 1, 1 }, { -1, -1 }, { -1, 1 } };
+   for (int d = 0; d < HALO_COUNT; ++d) {
+      block.aNeighbours[d] = cartNeighbour(gridComm, aOffsets[d][0], aOffsets[d][1]);
+   }
+   initHalo(&block, &block.halo, (void **)X, MPI_DOUBLE);
+   if (!fColour) {
+      initHalo(&block, &block.haloY, (void **)Y, MPI_DOUBLE);
+   }
 
-      if (procDownRightID >= 0) {
-         //printf("Process: %d, send/recv down right\n", myProcID);
-         MPI_Isend(&X[mySourceRowSize][mySourceColSize], 1, MPI_DOUBLE, procDownRightID, MESSAGE_SEND_DOWN_RIGHT, MPI_COMM_WORLD, &downRightSendRequest);
-         MPI_Irecv(&X[mySourceRowSize + 1][mySourceColSize + 1], 1, MPI_DOUBLE, procDownRightID, MESSAGE_SEND_UP_LEFT, MPI_COMM_WORLD, &downRightRecvRequest);
+   //
+   // With --precision fp32 or fp32-refine, solve in fp32 (and, refining,
+   // finish in fp64 from where fp32 stopped), then untimed in fp64 alone to
+   // see how far off that was.
+   //
+   Grid gridXF;
+   Grid gridYF;
+   Grid gridR;
+   if (fFloat) {
+      if (0 != createGridF(mySourceRowSize, mySourceColSize, false, &gridXF) ||
+          0 != createGridF(mySourceRowSize, mySourceColSize, false, &gridYF) ||
+          0 != createGrid(mySourceRowSize, mySourceColSize, false, &gridR)) {
+         MPI_Abort(MPI_COMM_WORLD, 1);
       }
+      parallelClear(&pool, 0, mySourceRowSize + 2, &gridXF);
+      parallelClear(&pool, 0, mySourceRowSize + 2, &gridYF);
+
+      block.XF = gridXF.aRowsF;
+      block.YF = gridYF.aRowsF;
+      initHalo(&block, &block.haloF, (void **)block.XF, MPI_FLOAT);
+      initHalo(&block, &block.haloFY, (void **)block.YF, MPI_FLOAT);
+      runThreadPool(&pool.pool, flushDenormalsWorker, pool.aWorkers, sizeof(ParallelWorker));
+   }
 
-      if (procUpLeftID >= 0) {
-         //printf("Process: %d, send/recv up left\n", myProcID);
-         MPI_Isend(&X[1][1], 1, MPI_DOUBLE, procUpLeftID, MESSAGE_SEND_UP_LEFT, MPI_COMM_WORLD, &upLeftSendRequest);
-         MPI_Irecv(&X[0][0], 1, MPI_DOUBLE, procUpLeftID, MESSAGE_SEND_DOWN_RIGHT, MPI_COMM_WORLD, &upLeftRecvRequest);
-      }
+   block.tCompute = block.tHalo = block.tWait = block.tReduce = 0.0;
+   block.cChecks = block.cLate = 0;
 
-      if (procUpRightID >= 0) {
-         //printf("Process: %d, send/recv up right\n", myProcID);
-         MPI_Isend(&X[1][mySourceColSize], 1, MPI_DOUBLE, procUpRightID, MESSAGE_SEND_UP_RIGHT, MPI_COMM_WORLD, &upRightSendRequest);
-         MPI_Irecv(&X[0][mySourceColSize+1], 1, MPI_DOUBLE, procUpRightID, MESSAGE_SEND_DOWN_LEFT, MPI_COMM_WORLD, &upRightRecvRequest);
-      }
+   MPI_Barrier(gridComm);
+   double tStart = MPI_Wtime();
 
-      if (procDownLeftID >= 0) {
-         //printf("Process: %d, wait down left\n", myProcID);
-         MPI_Wait(&downLeftSendRequest, &status);
-         MPI_Wait(&downLeftRecvRequest, &status);
-      }
+   int floatIterations = 0;
+   int iterations = 0;
+   if (fFloat) {
+      parallelToFloat(&pool, 0, mySourceRowSize + 2, &block);
+      block.tolerance = fRefine ? epsilonF : epsilon;
+      floatIterations = iterateF(&block);
+      block.tolerance = epsilon;
+      runThreadPool(&pool.pool, restoreDenormalsWorker, pool.aWorkers, sizeof(ParallelWorker));
+      parallelToDouble(&pool, 0, mySourceRowSize + 2, &block);
+   }
 
-      if (procDownRightID >= 0) {
-         //printf("Process: %d, wait down right\n", myProcID);
-         MPI_Wait(&downRightSendRequest, &status);
-         MPI_Wait(&downRightRecvRequest, &status);
-      }
+   if (!fFloat || fRefine) {
+      iterations = iterate(&block);
+   }
 
-      if (procUpLeftID >= 0) {
-         //printf("Process: %d, wait up left\n", myProcID);
-         MPI_Wait(&upLeftSendRequest, &status);
-         MPI_Wait(&upLeftRecvRequest, &status);
-      }
+   double tEnd = MPI_Wtime();
+   double aTimes[4] = { block.tCompute, block.tHalo, block.tWait, block.tReduce };
 
-      if (procUpRightID >= 0) {
-         //printf("Process: %d, wait up right\n", myProcID);
-         MPI_Wait(&upRightSendRequest, &status);
-         MPI_Wait(&upRightRecvRequest, &status);
+   //
+   // The fp64 solution from the same start: the error is against it after
+   // as many sweeps as the fp32 run took, and it goes on until it
+   // converges to count how many fp64 alone needs.  (Y's stale interior is
+   // all overwritten before it's read, and its halo refilled.)
+   //
+   int refIterations = 0;
+   double localError = 0.0;
+   if (fFloat) {
+      memcpy(gridR.pData, gridRow(block.X == X ? &gridX : &gridY, 0), gridR.cb);
+      for (int i = 0; i < mySourceRowSize + 2; ++i) {
+         memset(block.X[i], 0, sizeof(double) * (mySourceColSize + 2));
       }
-
-      // Now compute the stencil
-      for (int i = 1; i < mySourceRowSize+1; ++i) {
-         for (int j = 1; j < mySourceColSize+1; ++j) {
-            double center = X[i][j] * 0.25;
-            double adjacent = (X[i-1][j] + X[i+1][j] + X[i][j-1] + X[i][j+1]) * 0.125;
-            double diagonals = (X[i-1][j-1] + X[i+1][j-1] + X[i-1][j+1] + X[i+1][j+1]) * 0.0625;
-
-            Y[i][j] = 
-               (center + adjacent + diagonals);
+      placeSeeds(block.X, mySourceRow, mySourceRowSize, mySourceCol, mySourceColSize);
+
+      for (int k = 1; k <= floatIterations + iterations || 0 == refIterations; ++k) {
+         exchangeHalos(&block, &block.halo);
+         double localEpsilon = parallelSweep(&pool, 1, mySourceRowSize + 1, &block);
+         swapBlock(&block);
+         if (k == floatIterations + iterations) {
+            localError = blockError(&block, gridR.aRows);
          }
-      }
-
-      //outputArray(Y,myProcID,myRow,myCol,mySourceRowSize,mySourceColSize,numRows,numCols,numProcs);
-
-
-      /* TODO (step 7): Verify that the stencil seems to be progressing
-         correctly, as in assignment #5. */
-
-      //Done!
-
-
-      /* TODO (step 8): Use an MPI reduction to compute the termination of
-         the routine, as in assignment #5. */
-      double localEpsilon = 0.0;
-      for (int i = 1; i < mySourceRowSize+1; ++i) {
-         for (int j = 1; j< mySourceColSize+1; ++j) {
-            double le = fabs(Y[i][j] - X[i][j]);
-            if (le > localEpsilon) {
-               localEpsilon = le;
-            }
+         double globalEpsilon;
+         MPI_Allreduce(&localEpsilon, &globalEpsilon, 1, MPI_DOUBLE, MPI_MAX, gridComm);
+         if (globalEpsilon <= epsilon && 0 == refIterations) {
+            refIterations = k;
          }
       }
+   }
 
-      MPI_Allreduce(&localEpsilon, &globalEpsilon, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+   destroyParallelPool(&pool);
 
-      //Copy Y to X
-      for (int i = 1; i < mySourceRowSize+1; ++i) {
-         for (int j = 1; j< mySourceColSize+1; ++j) {
-            X[i][j] = Y[i][j];
-         }
-      }
-
-      ++iterations;
-   }
-   while (globalEpsilon > epsilon); 
    /* TODO (step 9): Verify that the results of the computation (output
       array, number of iterations) are the same as assignment #5 for a
       few different problem sizes and numbers of processors; be sure to
@@ -621,8 +1299,50 @@ int main(int argc, char *argv[]) {
 
    //printf("Process %d: Done! \n",myProcID);
    if (myProcID == 0) {
-      printf("%d iterations\n", iterations);
+      if (convergence == CONVERGENCE_SYNC) {
+         printf("%d iterations\n", floatIterations + iterations);
+      }
+      else {
+         printf("%d iterations, %s %lld past convergence (%lld reductions)\n", floatIterations + iterations,
+                convergence == CONVERGENCE_LAGGED ? "the last" : "up to", (long long)block.cLate, (long long)block.cChecks);
+      }
+      printf("%.9f\n", tEnd - tStart);
+   }
+
+   double aMaxTimes[4];
+   MPI_Reduce(aTimes, aMaxTimes, 4, MPI_DOUBLE, MPI_MAX, 0, gridComm);
+   if (myProcID == 0) {
+      double usPerIteration = 1e6 / (floatIterations + iterations);
+      printf("per iteration: compute %.1f us, halo %.1f us, wait %.1f us, allreduce %.1f us\n",
+             aMaxTimes[0] * usPerIteration, aMaxTimes[1] * usPerIteration, aMaxTimes[2] * usPerIteration, aMaxTimes[3] * usPerIteration);
+   }
+
+   if (fFloat) {
+      double globalError = 0.0;
+      MPI_Reduce(&localError, &globalError, 1, MPI_DOUBLE, MPI_MAX, 0, gridComm);
+      if (myProcID == 0) {
+         printf("%d fp32 + %d fp64 iterations, max error %.3g against as many fp64 iterations (fp64 alone converges in %d)\n",
+                floatIterations, iterations, globalError, refIterations);
+      }
+
+      freeHalo(&block.haloF);
+      freeHalo(&block.haloFY);
+      destroyGrid(&gridXF);
+      destroyGrid(&gridYF);
+      destroyGrid(&gridR);
+   }
+
+   if (fActive) {
+      destroyActiveTiles(&tiles);
+      free(aHalo);
+   }
+   freeHalo(&block.halo);
+   if (!fColour) {
+      freeHalo(&block.haloY);
    }
+   destroyGrid(&gridX);
+   destroyGrid(&gridY);
+   MPI_Comm_free(&gridComm);
 
    MPI_Finalize();
 return 0;
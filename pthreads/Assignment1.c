@@ -4,128 +4,289 @@
 #include <pthread.h>
 #include <time.h>
 #include <math.h>
+#include <string.h>
+#include <inttypes.h>
+#include "ThreadPool.h"
+#include "Timer.h"
+#include "Schedule.h"
+#include "Placement.h"
+#include "Kernels.h"
+#include "Stream.h"
+#include "Stats.h"
 
 #define MAX_RAMP_VALUE 15
+#if MAX_RAMP_VALUE > 15
+#error int4 storage needs every input value to fit in an unsigned nibble
+#endif
+#define DEFAULT_CHUNK 1024
+#define DEFAULT_SEED 1     // what rand() used when nobody called srand()
 
 void *ThreadProc(void* ptr);
-
-void computeMyBlockPart(
-   int64_t numItems, // # items to distribute
-   int64_t numTasks, // # of tasks
-   int64_t myTaskId, // my ID: 0..numTasks-1
-   int64_t *myLo,    // my low bound
-   int64_t *myHi     // my high bound
-   );   
-
-void computeMyCyclicPart(
-   int64_t numItems, // # items to distribute
-   int64_t numTasks, // # of tasks
-   int64_t myTaskId, // my ID: 0..numTasks-1
-   int64_t *myLo,    // my low bound
-   int64_t *myHi     // my high bound
-   );
-   
+void *InitThreadProc(void* ptr);
+void *PinThreadProc(void* ptr);
+void *CountersThreadProc(void* ptr);
 
 typedef struct
 {
    int64_t numItems;
    int64_t numTasks;
    int64_t myTaskId;
-   int64_t *aData;
-   bool fBlock;
+   KernelBuffers buffers;     // input items, and where the results go
+   STORAGE storage;           // how the input items are stored
+   STORAGE outputStorage;     // how the results are stored
+   SCHEDULE schedule;
+   ScheduleState *pSchedule;  // shared by all threads for the chunked schedules
+   const Kernels *pKernels;   // the negation & factorial kernels picked at startup
    bool fSimple;
+   bool fRandom;
+   uint64_t seed;
+   PIN_POLICY pin;
+   bool fStats;               // time & count this worker's part of every run
+   ThreadCounters counters;   // this worker's perf_event counters
+   ThreadSample sample;       // what this worker did in the last run
 } THREAD_PARAMS;
 
-int64_t parseCommandLine(int argc, char* argv[], int64_t *cThreads, int64_t *cTasks, bool *pfBlock, bool* pfSimple, bool* pfRandom);
+// Everything parseCommandLine pulls out of argv
+typedef struct
+{
+   int64_t cThreads;
+   int64_t cTasks;
+   SCHEDULE schedule;
+   int64_t cChunk;   // --chunk N|auto: items per chunk for the chunked schedules
+   bool fSimple;
+   bool fRandom;
+   uint64_t seed;    // --seed S: key for the random input
+   int64_t cRepeat;  // --repeat K: number of timed runs on the same pool
+   ALLOC_POLICY alloc; // --alloc: who first touches the array
+   PAGE_POLICY pages;  // --pages: what backs the array (updated to what we got)
+   PIN_POLICY pin;     // --pin: where the workers run
+   KERNEL_ISA isa;     // --kernel: which kernel implementation to run
+   STORAGE storage;    // --storage: int64, int8 or packed int4 input items
+   STATS_FORMAT stats; // --stats: per-thread table after the CSV line
+   IO_MODE io;         // --io: where the items live
+   const char *pszInput;  // --input: stream the items from this file ...
+   const char *pszOutput; // --output: ... and the results to this one
+   int64_t cWindow;       // --window: items per window when streaming
+   const char *pszWriteInput; // --write-input: just write the input to this file
+} OPTIONS;
+
+int64_t parseCommandLine(int argc, char* argv[], OPTIONS *pOptions);
 void usage();
 
-int64_t createThreads(int64_t cTasks, int64_t cItems, bool fBlock, bool fSimple,  int64_t * aData, pthread_t **aThreads, THREAD_PARAMS** aThreadParams);
-int64_t joinThreads(int64_t cTasks, int64_t cItems,  pthread_t* aThreads, THREAD_PARAMS* aThreadParams);
-
+int64_t createThreadParams(const OPTIONS *pOptions, const KernelBuffers *pBuffers, ScheduleState *pSchedule, const Kernels *pKernels, THREAD_PARAMS** aThreadParams);
 
-// timing code copied from 
-// http://www.guyrutenberg.com/2007/09/22/profiling-code-using-clock_gettime/
 
-struct timespec diff(struct timespec start, struct timespec end)
+int compareInt64(const void *a, const void *b)
 {
-	struct timespec temp;
-	if ((end.tv_nsec-start.tv_nsec)<0) {
-		temp.tv_sec = end.tv_sec-start.tv_sec-1;
-		temp.tv_nsec = 1000000000+end.tv_nsec-start.tv_nsec;
-	} else {
-		temp.tv_sec = end.tv_sec-start.tv_sec;
-		temp.tv_nsec = end.tv_nsec-start.tv_nsec;
-	}
-	return temp;
+   int64_t x = *(const int64_t*)a;
+   int64_t y = *(const int64_t*)b;
+   return (x > y) - (x < y);
 }
 
-// end copy
-
 int64_t rampValue(int64_t cItems, int64_t index);
-int64_t allocateArray(bool fRandom, int64_t cItems, int64_t ** aArray);
-int64_t test(bool fSimple, int64_t cItems, int64_t * aArray);
+int64_t randValue(uint64_t seed, int64_t index);
+int64_t allocateArray(const OPTIONS *pOptions, PAGE_POLICY *pPages, KernelBuffers *pBuffers);
+void freeArray(const OPTIONS *pOptions, KernelBuffers *pBuffers);
+void initializeArray(const OPTIONS *pOptions, const KernelBuffers *pBuffers);
+int64_t inputValue(bool fRandom, uint64_t seed, int64_t cItems, int64_t index);
+int64_t test(const OPTIONS *pOptions, const KernelBuffers *pBuffers);
+int64_t optionsInputValue(const void *pContext, int64_t index);
+int64_t streamArray(const OPTIONS *pOptions, ThreadPool *pPool, ScheduleState *pSchedule, THREAD_PARAMS *aParams, ThreadStats *aStats);
 
 int main (int argc, char *argv[])
 {
    struct timespec tStart;
    struct timespec tEnd;
-   pthread_t *aThreads;
-   THREAD_PARAMS *aParams;
-   int64_t * aArray = NULL;
+   ThreadPool pool;
+   bool fPool = false;
+   ScheduleState schedule;
+   bool fSchedule = false;
+   Kernels kernels;
+   THREAD_PARAMS *aParams = NULL;
+   KernelBuffers buffers = { NULL, NULL };
+   int64_t * aElapsed = NULL; // nanoseconds, one per repetition
+   ThreadStats *aStats = NULL; // one per thread, summed over the repetitions
+   int64_t tWall = 0;
+   OPTIONS options;
 
    int64_t iret = 0;
-   int64_t cThreads = 0;
-   int64_t cTasks = 0;
-   bool fBlock = false;
-   bool fSimple = true; 
-   bool fRandom = false;
 
-   iret = parseCommandLine(argc, argv, &cThreads, &cTasks, &fBlock, &fSimple, &fRandom);
+   iret = parseCommandLine(argc, argv, &options);
+
+   if (0 == iret && NULL != options.pszWriteInput) {
+      iret = writeInputFile(options.pszWriteInput, options.storage, options.cTasks, optionsInputValue, &options);
+      if (0 == iret) {
+         printf("Wrote %" PRId64 " %s %s items to %s\n", options.cTasks, options.fRandom ? "random" : "ramp",
+                storageName(options.storage), options.pszWriteInput);
+      }
+      return iret;
+   }
 
    if (0 == iret) {
-      iret = allocateArray(fRandom, cTasks, &aArray);
+      iret = selectKernels(options.isa, options.storage, &kernels);
+   }
+
+   // streaming only ever holds a couple of windows, see streamArray
+   if (0 == iret && options.io == IO_MEMORY) {
+      iret = allocateArray(&options, &options.pages, &buffers);
    }
 
    if (0 == iret) {
-      iret = clock_gettime(CLOCK_REALTIME, &tStart);
+      aElapsed = (int64_t*) calloc(options.cRepeat, sizeof(int64_t));
+      if (NULL == aElapsed) {
+         printf("Out of memory allocating timings!\n");
+         iret = 1;
+      }
    }
-   
+
+   if (0 == iret && options.stats != STATS_NONE) {
+      aStats = (ThreadStats*) calloc(options.cThreads, sizeof(ThreadStats));
+      if (NULL == aStats) {
+         printf("Out of memory allocating thread stats!\n");
+         iret = 1;
+      }
+   }
+
+   // The pool is created once, outside the timed region, and reused by
+   // every repetition.
    if (0 == iret) {
-      iret = createThreads(cThreads, cTasks, fBlock, fSimple, aArray, &aThreads, &aParams);
+      iret = createThreadPool(options.cThreads, &pool);
+      fPool = (0 == iret);
    }
 
    if (0 == iret) {
-      iret = joinThreads(cThreads, cTasks, aThreads, aParams);
-      aThreads = NULL;
-      aParams = NULL;
+      int64_t cScheduled = options.io == IO_MEMORY || options.cWindow > options.cTasks ? options.cTasks : options.cWindow;
+      iret = createSchedule(options.schedule, cScheduled, options.cThreads, options.cChunk, &schedule);
+      fSchedule = (0 == iret);
    }
 
-   clock_gettime(CLOCK_REALTIME, &tEnd);
+   if (0 == iret) {
+      iret = createThreadParams(&options, &buffers, &schedule, &kernels, &aParams);
+   }
+
+   // The counters count the thread that opens them, so each worker opens its own
+   if (0 == iret && options.stats != STATS_NONE) {
+      iret = runThreadPool(&pool, CountersThreadProc, aParams, sizeof(THREAD_PARAMS));
+   }
+
+   // Pin first, so that the pages are first touched from where they'll be used
+   if (0 == iret && options.pin != PIN_NONE) {
+      iret = runThreadPool(&pool, PinThreadProc, aParams, sizeof(THREAD_PARAMS));
+   }
+
+   if (0 == iret && options.io == IO_MEMORY) {
+      if (options.alloc == ALLOC_PARALLEL) {
+         iret = runThreadPool(&pool, InitThreadProc, aParams, sizeof(THREAD_PARAMS));
+      }
+      else {
+         initializeArray(&options, &buffers);
+      }
+   }
+
+   for (int64_t r = 0; 0 == iret && r < options.cRepeat; ++r) {
+      if (r > 0 && options.io == IO_MEMORY) {
+         // Put the input back (untimed) so every run sees the same work
+         if (options.alloc == ALLOC_PARALLEL) {
+            iret = runThreadPool(&pool, InitThreadProc, aParams, sizeof(THREAD_PARAMS));
+         }
+         else {
+            initializeArray(&options, &buffers);
+         }
+         resetSchedule(&schedule);
+      }
+
+      tStart = now();
+      if (options.io == IO_MEMORY) {
+         iret = runThreadPool(&pool, ThreadProc, aParams, sizeof(THREAD_PARAMS));
+      }
+      else {
+         iret = streamArray(&options, &pool, &schedule, aParams, aStats);
+      }
+      tEnd = now();
+
+      aElapsed[r] = timespecToNs(diff(tStart, tEnd));
+      tWall += aElapsed[r];
+
+      for (int64_t t = 0; NULL != aStats && options.io == IO_MEMORY && t < options.cThreads; ++t) {
+         addSample(&aStats[t], &aParams[t].sample, timespecToNs(tStart));
+      }
+   }
+
+   if (fPool) {
+      destroyThreadPool(&pool);
+   }
+
+   if (fSchedule) {
+      destroySchedule(&schedule);
+   }
+
+   if (0 == iret && options.io == IO_MEMORY) {
+      //test(&options, &buffers);
+   }
 
    if (0 == iret) {
-      //test(fSimple, cTasks, aArray);
+      // nearest-rank statistics over the repetitions
+      int64_t k = options.cRepeat;
+      qsort(aElapsed, k, sizeof(int64_t), compareInt64);
+      int64_t tMin = aElapsed[0];
+      int64_t tMedian = aElapsed[(k - 1) / 2];
+      int64_t tP95 = aElapsed[(95 * k + 99) / 100 - 1];
+
+      //printf("Elapsed Time: %d.%09d Sec.\n", tsDiff.tv_sec, tsDiff.tv_nsec);
+      // threads, tasks, schedule, kernel, input, median, repeats, min, p95, chunk, alloc, pages, pin, seed, isa, storage, io, window
+      printf("%" PRId64 ", %" PRId64 ", %s, %s, %s, %.9f, %" PRId64 ", %.9f, %.9f, %" PRId64 ", %s, %s, %s, %" PRIu64 ", %s, %s, %s, %" PRId64 "\n",
+             options.cThreads, options.cTasks,
+             scheduleName(options.schedule), options.fSimple ? "negation":"factorial", options.fRandom ? "random":"ramp",
+             tMedian / 1e9, k, tMin / 1e9, tP95 / 1e9,
+             isChunkedSchedule(options.schedule) ? options.cChunk : 0,
+             allocPolicyName(options.alloc), pagePolicyName(options.pages), pinPolicyName(options.pin),
+             options.seed, kernelIsaName(kernels.isa), storageName(options.storage),
+             ioModeName(options.io), options.io == IO_MEMORY ? 0 : options.cWindow);
+
+      if (NULL != aStats) {
+         printStats(options.stats, aStats, options.cThreads, options.cRepeat, tWall);
+      }
+   }
+
+   for (int64_t t = 0; NULL != aParams && t < options.cThreads; ++t) {
+      closeCounters(&aParams[t].counters);
    }
 
-   free(aArray);
+   free(aStats);
+   free(aParams);
+   free(aElapsed);
+   freeArray(&options, &buffers);
 
-   struct timespec tsDiff = diff(tStart, tEnd);
-   //printf("Elapsed Time: %d.%09d Sec.\n", tsDiff.tv_sec, tsDiff.tv_nsec);
-   printf("%d, %d, %s, %s, %s, %d.%09d\n", cThreads, cTasks, fBlock ? "block":"cyclic", fSimple ? "negation":"factorial", fRandom ? "random":"ramp",tsDiff.tv_sec, tsDiff.tv_nsec);
    return(iret);
 }
 
-int64_t parseCommandLine(int argc, char* argv[], int64_t *cThreads, int64_t *cTasks, bool *pfBlock, bool* pfSimple, bool *pfRandom){ 
+int64_t parseCommandLine(int argc, char* argv[], OPTIONS *pOptions){ 
    int64_t iret = 0;
-   if (argc != 6) {
+   if (argc < 6) {
       usage();
       iret = 1;
    }
-   *pfBlock = false;
-   *pfRandom = false;
+   pOptions->schedule = SCHEDULE_CYCLIC;
+   pOptions->cChunk = 0; // pick the schedule's default below
+   pOptions->fSimple = true;
+   pOptions->fRandom = false;
+   pOptions->seed = DEFAULT_SEED;
+   pOptions->cRepeat = 1;
+   pOptions->alloc = ALLOC_SERIAL;
+   pOptions->pages = PAGES_DEFAULT;
+   pOptions->pin = PIN_NONE;
+   pOptions->isa = KERNEL_AUTO;
+   pOptions->storage = STORAGE_INT64;
+   pOptions->stats = STATS_NONE;
+   pOptions->io = IO_MEMORY;
+   pOptions->pszInput = NULL;
+   pOptions->pszOutput = NULL;
+   pOptions->cWindow = DEFAULT_WINDOW;
+   pOptions->pszWriteInput = NULL;
 
    if (0 == iret) {
-      *cThreads = atol(argv[1]);
-      if (*cThreads <= 0 || *cThreads > 1000) {
+      pOptions->cThreads = atol(argv[1]);
+      if (pOptions->cThreads <= 0 || pOptions->cThreads > 1000) {
          usage();
          printf("Must be between 1 and 1000 threads.\n");
          iret = 1;
@@ -133,8 +294,8 @@ int64_t parseCommandLine(int argc, char* argv[], int64_t *cThreads, int64_t *cTa
    }
 
    if (0 == iret) {
-      *cTasks = atol(argv[2]);
-      if (*cTasks <= 0 || *cTasks > 10E9) {
+      pOptions->cTasks = atol(argv[2]);
+      if (pOptions->cTasks <= 0 || pOptions->cTasks > 10E9) {
          usage();
          printf("Must be between 1 and 10E9 tasks.\n");
          iret = 1;
@@ -142,28 +303,17 @@ int64_t parseCommandLine(int argc, char* argv[], int64_t *cThreads, int64_t *cTa
    }
 
    if (0 == iret) {
-      *cTasks = atol(argv[2]);
-      if (*cTasks <= 0 || *cTasks > 10E9) {
+      pOptions->schedule = parseSchedule(argv[3]);
+      if (pOptions->schedule == SCHEDULE_COUNT) {
          usage();
-         printf("Must choose block or cyclic");
+         printf("Must choose block, cyclic, block-cyclic, dynamic, guided or stealing\n");
          iret = 1;
       }
    }
 
-   if (0 == iret) {
-      if (argv[3][0] == 'b') {
-         *pfBlock = true;
-         //printf("Block\n");
-      }
-      else
-      {
-         //rintf("Cyclic\n");
-      }
-   }
-
    if (0 == iret) {
       if (argv[4][0] == 'c') {
-         *pfSimple = false;
+         pOptions->fSimple = false;
          //rintf("Complex\n");
       }
       else
@@ -174,7 +324,7 @@ int64_t parseCommandLine(int argc, char* argv[], int64_t *cThreads, int64_t *cTa
 
    if (0 == iret) {
       if (argv[5][0] == 'r') {
-         *pfRandom = true;
+         pOptions->fRandom = true;
          //rintf("Complex\n");
       }
       else
@@ -183,197 +333,348 @@ int64_t parseCommandLine(int argc, char* argv[], int64_t *cThreads, int64_t *cTa
       }
    }
 
-   if (iret == 0) {
-      // automaticall clamp the number of threads to the number of tasks
-      if (*cThreads > *cTasks) {
-         *cThreads = *cTasks;
+   // optional --name value pairs follow the positional arguments
+   for (int i = 6; 0 == iret && i < argc; i += 2) {
+      if (i + 1 >= argc) {
+         usage();
+         printf("Missing value for %s\n", argv[i]);
+         iret = 1;
+      }
+      else if (0 == strcmp(argv[i], "--repeat")) {
+         pOptions->cRepeat = atol(argv[i + 1]);
+         if (pOptions->cRepeat <= 0 || pOptions->cRepeat > 100000) {
+            usage();
+            printf("Must repeat between 1 and 100000 times.\n");
+            iret = 1;
+         }
+      }
+      else if (0 == strcmp(argv[i], "--chunk")) {
+         if (0 == strcmp(argv[i + 1], "auto")) {
+            pOptions->cChunk = -1;
+         }
+         else {
+            pOptions->cChunk = atol(argv[i + 1]);
+            if (pOptions->cChunk <= 0) {
+               pOptions->cChunk = 0;
+            }
+         }
+         if (0 == pOptions->cChunk) {
+            usage();
+            printf("Chunk size must be at least 1.\n");
+            iret = 1;
+         }
+      }
+      else if (0 == strcmp(argv[i], "--seed")) {
+         pOptions->seed = strtoull(argv[i + 1], NULL, 0);
+      }
+      else if (0 == strcmp(argv[i], "--kernel")) {
+         pOptions->isa = parseKernelIsa(argv[i + 1]);
+         if (pOptions->isa == KERNEL_COUNT) {
+            usage();
+            printf("Kernel must be auto, scalar, avx2 or avx512.\n");
+            iret = 1;
+         }
+      }
+      else if (0 == strcmp(argv[i], "--storage")) {
+         pOptions->storage = parseStorage(argv[i + 1]);
+         if (pOptions->storage == STORAGE_COUNT) {
+            usage();
+            printf("Storage must be int64, int8 or int4.\n");
+            iret = 1;
+         }
+      }
+      else if (0 == strcmp(argv[i], "--stats")) {
+         pOptions->stats = parseStatsFormat(argv[i + 1]);
+         if (pOptions->stats == STATS_COUNT) {
+            usage();
+            printf("Stats must be none, text or json.\n");
+            iret = 1;
+         }
+      }
+      else if (0 == strcmp(argv[i], "--io")) {
+         pOptions->io = parseIoMode(argv[i + 1]);
+         if (pOptions->io == IO_COUNT) {
+            usage();
+            printf("I/O must be memory, mmap or pread.\n");
+            iret = 1;
+         }
+      }
+      else if (0 == strcmp(argv[i], "--input")) {
+         pOptions->pszInput = argv[i + 1];
+      }
+      else if (0 == strcmp(argv[i], "--output")) {
+         pOptions->pszOutput = argv[i + 1];
+      }
+      else if (0 == strcmp(argv[i], "--write-input")) {
+         pOptions->pszWriteInput = argv[i + 1];
+      }
+      else if (0 == strcmp(argv[i], "--window")) {
+         pOptions->cWindow = atol(argv[i + 1]);
+         if (pOptions->cWindow <= 0) {
+            usage();
+            printf("Window must be at least 1 item.\n");
+            iret = 1;
+         }
+      }
+      else if (0 == strcmp(argv[i], "--alloc")) {
+         pOptions->alloc = parseAllocPolicy(argv[i + 1]);
+         if (pOptions->alloc == ALLOC_COUNT) {
+            usage();
+            printf("Must allocate serial or parallel.\n");
+            iret = 1;
+         }
+      }
+      else if (0 == strcmp(argv[i], "--pages")) {
+         pOptions->pages = parsePagePolicy(argv[i + 1]);
+         if (pOptions->pages == PAGES_COUNT) {
+            usage();
+            printf("Pages must be default, thp or huge.\n");
+            iret = 1;
+         }
+      }
+      else if (0 == strcmp(argv[i], "--pin")) {
+         pOptions->pin = parsePinPolicy(argv[i + 1]);
+         if (pOptions->pin == PIN_COUNT) {
+            usage();
+            printf("Must pin to none, core or node.\n");
+            iret = 1;
+         }
+      }
+      else {
+         usage();
+         printf("Unknown option %s\n", argv[i]);
+         iret = 1;
       }
    }
 
-   return iret;
-}
+   if (iret == 0) {
+      // Block-cyclic defaults to one cache line of items so neighbouring
+      // threads never share a line; the rest default to DEFAULT_CHUNK.
+      // "auto" rounds that default up to whole lines of the detected size.
+      int64_t cItemsPerLine = CACHE_LINE_SIZE / sizeof(int64_t);
+      if (pOptions->cChunk < 0) {
+         cItemsPerLine = cacheLineSize() / sizeof(int64_t);
+      }
 
-void usage(){
-   printf("Assignment1 Usage:\n");
-   printf("\t Assignment1 coutOfThreads coutOfTasks b[lock]|c[yclic] s[imple]|c[omplex] m[onotonic]|r[andom]\n");
-   printf("\n");
-}
+      if (pOptions->cChunk <= 0) {
+         int64_t cDefault = pOptions->schedule == SCHEDULE_BLOCK_CYCLIC ? cItemsPerLine : DEFAULT_CHUNK;
+         pOptions->cChunk = (cDefault + cItemsPerLine - 1) / cItemsPerLine * cItemsPerLine;
+      }
+   }
 
-void computeMyBlockPart(
-   int64_t numItems, // # items to distribute
-   int64_t numTasks, // # of tasks
-   int64_t myTaskId, // my ID: 0..numTasks-1
-   int64_t *myLo,    // my low bound
-   int64_t *myHi)    // my high bound
-{    
-   // compute the block
-   int64_t size = numItems / numTasks;  // note: integer division
-   int64_t remainder = numItems % numTasks;
+   if (iret == 0) {
+      // --input streams with mmap unless told otherwise; windows are whole pages
+      if (NULL != pOptions->pszInput && pOptions->io == IO_MEMORY) {
+         pOptions->io = IO_MMAP;
+      }
+      pOptions->cWindow = roundWindow(pOptions->cWindow);
 
-   // now divide the remaining tasks up
-   if (myTaskId < remainder) {
-      size += 1;
+      if ((pOptions->io != IO_MEMORY || NULL != pOptions->pszOutput) && (NULL == pOptions->pszInput || NULL == pOptions->pszOutput)) {
+         usage();
+         printf("Streaming needs both --input and --output.\n");
+         iret = 1;
+      }
    }
 
-   int64_t lo = size * myTaskId;
-   if (myTaskId >= remainder) {
-      lo += remainder;
+   if (iret == 0) {
+      // automaticall clamp the number of threads to the number of tasks
+      if (pOptions->cThreads > pOptions->cTasks) {
+         pOptions->cThreads = pOptions->cTasks;
+      }
    }
 
-   *myLo = lo;
-   *myHi = lo + size;
+   return iret;
 }
 
-void computeMyCyclicPart(
-   int64_t numItems, // # items to distribute
-   int64_t numTasks, // # of tasks
-   int64_t myTaskId, // my ID: 0..numTasks-1
-   int64_t *myLo,    // my low bound
-   int64_t *myHi     // my high bound
-   ) 
-{    
-   //int64_t Hi = numItems - numItems % numTasks + myTaskId;
-   //if (myTaskId > numItems % numTasks) {
-   //   Hi -= numTasks;   
-   //}
-
-   *myLo = myTaskId;
-   *myHi = numItems;
-
-   //printf("Lo: %d Hi:%d Stride:%d\n", myTaskId, numItems, numTasks);
-
+void usage(){
+   printf("Assignment1 Usage:\n");
+   printf("\t Assignment1 coutOfThreads coutOfTasks b[lock]|c[yclic]|bc|block-cyclic|d[ynamic]|g[uided]|s[tealing] s[imple]|c[omplex] m[onotonic]|r[andom] [options]\n");
+   printf("\t   --repeat K   time K runs on one thread pool and report min, median and p95\n");
+   printf("\t   --chunk N    items per block for block-cyclic (default one cache line) and per chunk for\n");
+   printf("\t                dynamic and stealing, smallest chunk for guided (default %d)\n", DEFAULT_CHUNK);
+   printf("\t   --chunk auto size the chunk in whole lines of the detected cache line size\n");
+   printf("\t   --alloc serial|parallel    initialize on the main thread, or first touch each part\n");
+   printf("\t                              from the worker that will compute on it\n");
+   printf("\t   --pages default|thp|huge   back the array with malloc, transparent or explicit huge pages\n");
+   printf("\t   --pin none|core|node       pin worker i to the i'th cpu or to numa node i %% #nodes\n");
+   printf("\t   --kernel auto|scalar|avx2|avx512  kernel implementation (auto: widest the cpu has)\n");
+   printf("\t   --storage int64|int8|int4  store the input as int64, int8 or two 4 bit items per byte; negation\n");
+   printf("\t                              writes int8 (in place for int8), factorial a separate int64 array\n");
+   printf("\t   --stats none|text|json     per-thread start, busy time, items, cycles, instructions and\n");
+   printf("\t                              LLC misses, plus max/mean busy time and idle fraction\n");
+   printf("\t   --input FILE --output FILE  stream the items from FILE and the results to FILE, a window\n");
+   printf("\t                              at a time, instead of holding the whole array in memory\n");
+   printf("\t   --io mmap|pread            map the files, or read / write windows on a second thread\n");
+   printf("\t                              while the workers compute on the current one (default mmap)\n");
+   printf("\t   --window N   items per streaming window, rounded up to whole pages (default %d)\n", DEFAULT_WINDOW);
+   printf("\t   --write-input FILE         write coutOfTasks input items in --storage format to FILE and exit\n");
+   printf("\t   --seed S     key for the random input; the same seed gives the same array (default %d)\n", DEFAULT_SEED);
+   printf("\n");
 }
 
 int64_t rampValue(int64_t cItems, int64_t index){
    int64_t out;
    double numItems = (double)cItems;
-   double value = (index / cItems) * MAX_RAMP_VALUE;
+   double value = (index / numItems) * MAX_RAMP_VALUE;
    value = ceil(value);
    out = (int64_t)value;
    return out;
 }
 
-int64_t randValue(int64_t cItems, int64_t index){
+// SplitMix64's finalizer: a bijection that scrambles every input bit
+// into every output bit.
+uint64_t mix64(uint64_t z){
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+   return z ^ (z >> 31);
+}
+
+// Counter based: the value is a pure function of (seed, index), so any
+// thread can fill any slice of the array and get the same contents.
+int64_t randValue(uint64_t seed, int64_t index){
    int64_t out;
-   out = rand() % MAX_RAMP_VALUE;
+   uint64_t z = mix64(mix64(seed) + (uint64_t)index * 0x9e3779b97f4a7c15ULL);
+   // scale the top 32 bits down to 0..MAX_RAMP_VALUE-1, like rand() % MAX_RAMP_VALUE did
+   out = (int64_t)(((z >> 32) * MAX_RAMP_VALUE) >> 32);
    return out;
 }
 
-int64_t allocateArray(bool fRandom, int64_t cItems, int64_t ** aArray){
+int64_t inputValue(bool fRandom, uint64_t seed, int64_t cItems, int64_t index){
+   return fRandom ? randValue(seed, index) : rampValue(cItems, index);
+}
+
+// inputValue for writeInputFile
+int64_t optionsInputValue(const void *pContext, int64_t index){
+   const OPTIONS *pOptions = (const OPTIONS*)pContext;
+   return inputValue(pOptions->fRandom, pOptions->seed, pOptions->cTasks, index);
+}
+
+// Push the input file through the workers a window at a time.  While the
+// workers compute on one window, the stream writes back the one before and
+// fetches the one after.
+int64_t streamArray(const OPTIONS *pOptions, ThreadPool *pPool, ScheduleState *pSchedule, THREAD_PARAMS *aParams, ThreadStats *aStats){
    int64_t iret = 0;
-   int64_t *ary = NULL;
-   ary = (int64_t *) malloc(cItems * sizeof(int64_t));
-   if (NULL == ary) {
-      printf("Out Of Memory in allocateArray\n");
-      iret = 1; // OUT OF MEMORY!
+   Stream stream;
+   StreamWindow window;
+
+   iret = openStream(pOptions->io, pOptions->pszInput, pOptions->pszOutput, pOptions->storage,
+                     outputStorage(pOptions->storage, pOptions->fSimple), pOptions->cTasks, pOptions->cWindow, &stream);
+   if (0 != iret) {
+      return iret;
    }
 
-   if (0 == iret) {
-      //Initialize
-      if (fRandom) {
-         for (int64_t i = 0; i < cItems; i++) {
-            ary[i] = randValue(cItems,i);
-         }
+   while (0 == iret && nextWindow(&stream, &window)) {
+      resizeSchedule(pSchedule, window.cItems);
+      for (int64_t t = 0; t < pOptions->cThreads; ++t) {
+         aParams[t].numItems = window.cItems;
+         aParams[t].buffers = window.buffers;
       }
-      else{
-         for (int64_t i = 0; i < cItems; i++) {
-            ary[i] = rampValue(cItems,i);
-         }
+
+      int64_t tWindowStart = nowNs();
+      iret = runThreadPool(pPool, ThreadProc, aParams, sizeof(THREAD_PARAMS));
+
+      for (int64_t t = 0; NULL != aStats && t < pOptions->cThreads; ++t) {
+         addSample(&aStats[t], &aParams[t].sample, tWindowStart);
       }
    }
 
-   if (0 == iret) {
-      *aArray = ary;
-   }
-   else
-   {
-      free(ary);
+   int64_t iretStream = closeStream(&stream);
+   return 0 != iret ? iret : iretStream;
+}
+
+// True when the results don't fit in the input array and get their own
+bool hasSeparateOutput(const OPTIONS *pOptions){
+   return outputStorage(pOptions->storage, pOptions->fSimple) != pOptions->storage;
+}
+
+// Allocate, but don't touch, the input and output arrays; see
+// initializeArray & InitThreadProc
+int64_t allocateArray(const OPTIONS *pOptions, PAGE_POLICY *pPages, KernelBuffers *pBuffers){
+   int64_t iret = 0;
+   STORAGE output = outputStorage(pOptions->storage, pOptions->fSimple);
+
+   // line aligned, so that blocks of whole cache lines really are whole lines
+   iret = allocatePages(storageBytes(pOptions->storage, pOptions->cTasks), cacheLineSize(), pPages, &pBuffers->pInput);
+   pBuffers->pOutput = pBuffers->pInput;
+
+   if (0 == iret && hasSeparateOutput(pOptions)) {
+      PAGE_POLICY pages = *pPages;
+      iret = allocatePages(storageBytes(output, pOptions->cTasks), cacheLineSize(), &pages, &pBuffers->pOutput);
+      if (0 != iret) {
+         freePages(pBuffers->pInput, storageBytes(pOptions->storage, pOptions->cTasks), *pPages);
+         pBuffers->pInput = NULL;
+         pBuffers->pOutput = NULL;
+      }
+      else if (pages != *pPages) {
+         // keep what we report honest if the second array fell back
+         freePages(pBuffers->pInput, storageBytes(pOptions->storage, pOptions->cTasks), *pPages);
+         *pPages = pages;
+         iret = allocatePages(storageBytes(pOptions->storage, pOptions->cTasks), cacheLineSize(), pPages, &pBuffers->pInput);
+      }
    }
 
    return iret;
 }
 
-int64_t createThreads(int64_t cTasks, int64_t cItems, bool fBlock, bool fSimple, int64_t *aData, pthread_t **aThreads, THREAD_PARAMS **aParams){
+void freeArray(const OPTIONS *pOptions, KernelBuffers *pBuffers){
+   if (hasSeparateOutput(pOptions)) {
+      freePages(pBuffers->pOutput, storageBytes(outputStorage(pOptions->storage, pOptions->fSimple), pOptions->cTasks), pOptions->pages);
+   }
+   freePages(pBuffers->pInput, storageBytes(pOptions->storage, pOptions->cTasks), pOptions->pages);
+   pBuffers->pInput = NULL;
+   pBuffers->pOutput = NULL;
+}
+
+void initializeArray(const OPTIONS *pOptions, const KernelBuffers *pBuffers){
+   STORAGE output = outputStorage(pOptions->storage, pOptions->fSimple);
+
+   for (int64_t i = 0; i < pOptions->cTasks; i++) {
+      storeItem(pOptions->storage, pBuffers->pInput, i, inputValue(pOptions->fRandom, pOptions->seed, pOptions->cTasks, i));
+   }
+
+   if (hasSeparateOutput(pOptions)) {
+      memset(pBuffers->pOutput, 0, storageBytes(output, pOptions->cTasks));
+   }
+}
+
+int64_t createThreadParams(const OPTIONS *pOptions, const KernelBuffers *pBuffers, ScheduleState *pSchedule, const Kernels *pKernels, THREAD_PARAMS **aParams){
    int64_t iret = 0; 
-   pthread_t *threads = NULL;
    THREAD_PARAMS *params = NULL;
    
    // initialize output parameters
-   *aThreads = NULL;
    *aParams = NULL;
 
-   // allocate the thread contexts
-   threads = (pthread_t*) calloc(cTasks, sizeof(pthread_t));
-   if (NULL == threads) {
-      printf("Out of memory allocating pthreat_t*!\n");
-      iret = 1; //out of memory
-   }
-
    // allocate the thead params
-   if (0 == iret) {
-      params = (THREAD_PARAMS*) calloc(cTasks, sizeof(THREAD_PARAMS));
-      if (NULL == params) {
-         printf("Out of memroy allocating params!\n");
-         iret = 1; // out of memory
-      }
+   params = (THREAD_PARAMS*) calloc(pOptions->cThreads, sizeof(THREAD_PARAMS));
+   if (NULL == params) {
+      printf("Out of memroy allocating params!\n");
+      iret = 1; // out of memory
    }
 
    if (0 == iret) {
-
-      
-      for (int64_t i = 0; i < cTasks; ++i) {
+      for (int64_t i = 0; i < pOptions->cThreads; ++i) {
          // Initialize the thread params
          params[i].myTaskId = i;
-         params[i].numTasks = cTasks;
-         params[i].numItems = cItems; 
-         params[i].aData = aData;
-         params[i].fBlock = fBlock;
-         params[i].fSimple = fSimple;
-
-         iret = pthread_create(&threads[i], NULL, ThreadProc, &params[i]);
-         if (0 != iret) {
-            printf("Failed to create threads!");
-            break;
-            // I'm not going to worry about cleaning this mess up if only some threads are created.
+         params[i].numTasks = pOptions->cThreads;
+         params[i].numItems = pOptions->cTasks; 
+         params[i].buffers = *pBuffers;
+         params[i].storage = pOptions->storage;
+         params[i].outputStorage = outputStorage(pOptions->storage, pOptions->fSimple);
+         params[i].schedule = pOptions->schedule;
+         params[i].pSchedule = pSchedule;
+         params[i].pKernels = pKernels;
+         params[i].fSimple = pOptions->fSimple;
+         params[i].fRandom = pOptions->fRandom;
+         params[i].seed = pOptions->seed;
+         params[i].pin = pOptions->pin;
+         params[i].fStats = pOptions->stats != STATS_NONE;
+         for (int c = 0; c < COUNTER_COUNT; ++c) {
+            params[i].counters.aFd[c] = -1;   // opened by CountersThreadProc
          }
       }
-   }
 
-   if (0 == iret) {
-      *aThreads = threads;
       *aParams = params;
    }
-   else {
-      // Cleanup
-      if (NULL != threads) {
-         free(threads);
-         threads = NULL;
-      }
-
-      if (NULL != params) {
-         free(params);
-         params = NULL;
-      }
-   }
-
-   return iret;
-}
-
-
-int64_t joinThreads(int64_t cTasks, int64_t cItems, pthread_t* aThreads, THREAD_PARAMS* aParams){
-   int64_t iret = 0;
-   // Join 'dem threads
-   for (int64_t i = 0; i < cTasks; ++i) {
-      iret = pthread_join(aThreads[i], NULL);
-      if (0 != iret) {
-         printf("Failed to join threads!");
-         break;
-      }
-   }
-
-   //free(aParams[0].aData);
-   free(aThreads);
-   free(aParams);
 
    return iret;
 }
@@ -388,49 +689,164 @@ int64_t fact(int64_t x)
    return out;
 }
 
-void *ThreadProc(void *ptr){
-   THREAD_PARAMS *pParams = (THREAD_PARAMS*)ptr;
-   int64_t myLo = 0;
-   int64_t myHi = 0;
-   int64_t final = 0;
-   int64_t stride = 1;
+// Apply the kernel to items lo, lo+stride, ... below hi
+void processRange(THREAD_PARAMS *pParams, int64_t myLo, int64_t myHi, int64_t stride){
+   int64_t i;
+   const void *pIn = pParams->buffers.pInput;
+   void *pOut = pParams->buffers.pOutput;
 
-   if (pParams->fBlock) {
-      computeMyBlockPart(pParams->numItems, pParams->numTasks, pParams->myTaskId, &myLo, &myHi);
+   if (myHi > myLo) {
+      pParams->sample.cItems += (myHi - myLo + stride - 1) / stride;
    }
-   else{
-      computeMyCyclicPart(pParams->numItems, pParams->numTasks, pParams->myTaskId, &myLo, &myHi);
-      stride = pParams->numTasks;
+
+   // contiguous ranges go to the (vectorized) kernels
+   if (stride == 1) {
+      if (pParams->fSimple) {
+         negateRange(pParams->pKernels, &pParams->buffers, myLo, myHi);
+      }
+      else {
+         factorialRange(pParams->pKernels, &pParams->buffers, myLo, myHi);
+      }
+      return;
    }
 
-   int64_t i;
+   // int4 items never get written in place, so the one item at a time
+   // stores below never touch half of somebody else's byte
    if (pParams->fSimple) {
       // Simple Calculation
       for (i = myLo; i < myHi; i += stride) {
-         pParams->aData[i] = -pParams->aData[i];
+         storeItem(pParams->outputStorage, pOut, i, -loadItem(pParams->storage, pIn, i));
       }
    }
    else{
       // Complex Calculation
       for (i = myLo; i < myHi; i += stride) {
-         pParams->aData[i] = fact(pParams->aData[i]);
+         storeItem(pParams->outputStorage, pOut, i, tableFact(loadItem(pParams->storage, pIn, i)));
+      }
+   }
+}
+
+// Fill in the input of items lo, lo+stride, ... below hi (and clear their
+// results when those have an array of their own)
+void initializeRange(THREAD_PARAMS *pParams, int64_t myLo, int64_t myHi, int64_t stride){
+   void *pIn = pParams->buffers.pInput;
+
+   for (int64_t i = myLo; i < myHi; i += stride) {
+      if (pParams->storage == STORAGE_INT4) {
+         // Whoever owns the even item writes the whole byte, so no two
+         // threads ever rewrite the same byte.
+         if (0 == (i & 1)) {
+            storeItem(STORAGE_INT4, pIn, i, inputValue(pParams->fRandom, pParams->seed, pParams->numItems, i));
+            if (i + 1 < pParams->numItems) {
+               storeItem(STORAGE_INT4, pIn, i + 1, inputValue(pParams->fRandom, pParams->seed, pParams->numItems, i + 1));
+            }
+         }
+      }
+      else {
+         storeItem(pParams->storage, pIn, i, inputValue(pParams->fRandom, pParams->seed, pParams->numItems, i));
+      }
+
+      if (pParams->buffers.pOutput != pIn) {
+         storeItem(pParams->outputStorage, pParams->buffers.pOutput, i, 0);
+      }
+   }
+}
+
+// Hand pfnRange every range this thread owns under the given schedule
+void processMyPart(THREAD_PARAMS *pParams, SCHEDULE schedule, void (*pfnRange)(THREAD_PARAMS *, int64_t, int64_t, int64_t)){
+   int64_t myLo = 0;
+   int64_t myHi = 0;
+
+   switch (schedule) {
+   case SCHEDULE_BLOCK:
+      computeMyBlockPart(pParams->numItems, pParams->numTasks, pParams->myTaskId, &myLo, &myHi);
+      pfnRange(pParams, myLo, myHi, 1);
+      break;
+
+   case SCHEDULE_CYCLIC:
+      computeMyCyclicPart(pParams->numItems, pParams->numTasks, pParams->myTaskId, &myLo, &myHi);
+      pfnRange(pParams, myLo, myHi, pParams->numTasks);
+      break;
+
+   case SCHEDULE_BLOCK_CYCLIC: {
+      int64_t blockSize = pParams->pSchedule->chunk;
+      int64_t stride = 0;
+      computeMyBlockCyclicPart(pParams->numItems, pParams->numTasks, pParams->myTaskId, blockSize, &myLo, &myHi, &stride);
+      for (int64_t lo = myLo; lo < myHi; lo += stride) {
+         pfnRange(pParams, lo, lo + blockSize < myHi ? lo + blockSize : myHi, 1);
       }
+      break;
    }
 
+   default:
+      // dynamic, guided & stealing: keep asking for chunks till they run out
+      while (nextChunk(pParams->pSchedule, pParams->myTaskId, &myLo, &myHi)) {
+         pfnRange(pParams, myLo, myHi, 1);
+      }
+      break;
+   }
+}
+
+void *ThreadProc(void *ptr){
+   THREAD_PARAMS *pParams = (THREAD_PARAMS*)ptr;
+
+   if (pParams->fStats) {
+      beginSample(&pParams->counters, &pParams->sample);
+   }
+
+   processMyPart(pParams, pParams->schedule, processRange);
+
+   if (pParams->fStats) {
+      endSample(&pParams->counters, &pParams->sample);
+   }
 
    //printf("Task: %d \t i: %d \n",pParams->myTaskId, i );
    return NULL;
 }
 
-int64_t test(bool fSimple, int64_t cItems, int64_t * aArray)
+// First touch: each worker writes the input into the pages it will compute
+// on.  The dynamic schedules can't be predicted, so they get the block
+// partition, which is also how the stealing deques start out.
+void *InitThreadProc(void *ptr){
+   THREAD_PARAMS *pParams = (THREAD_PARAMS*)ptr;
+   SCHEDULE schedule = pParams->schedule;
+
+   if (isChunkedSchedule(schedule) && schedule != SCHEDULE_BLOCK_CYCLIC) {
+      schedule = SCHEDULE_BLOCK;
+   }
+
+   processMyPart(pParams, schedule, initializeRange);
+   return NULL;
+}
+
+void *PinThreadProc(void *ptr){
+   THREAD_PARAMS *pParams = (THREAD_PARAMS*)ptr;
+
+   pinThread(pParams->pin, pParams->myTaskId);
+   return NULL;
+}
+
+void *CountersThreadProc(void *ptr){
+   THREAD_PARAMS *pParams = (THREAD_PARAMS*)ptr;
+
+   openCounters(&pParams->counters);
+   return NULL;
+}
+
+int64_t test(const OPTIONS *pOptions, const KernelBuffers *pBuffers)
 {
+   bool fSimple = pOptions->fSimple;
+   bool fRandom = pOptions->fRandom;
+   int64_t cItems = pOptions->cTasks;
+   STORAGE output = outputStorage(pOptions->storage, fSimple);
+
    int64_t minramp = rampValue(cItems,0);
    int64_t maxramp = minramp;
    int64_t last = minramp;
 
 
    for (int64_t i = 0; i < cItems; ++i) {
-      int64_t initialValue = rampValue(cItems, i);
+      int64_t initialValue = inputValue(fRandom, pOptions->seed, cItems, i);
 
       if (initialValue < minramp) {
          minramp = initialValue;
@@ -440,7 +856,7 @@ int64_t test(bool fSimple, int64_t cItems, int64_t * aArray)
          maxramp = initialValue;
       }
 
-      if (initialValue < last) {
+      if (!fRandom && initialValue < last) {
          printf("Bad Ramp! index:%d  last:%d cur:%d", i, last, initialValue);
       }
 
@@ -452,8 +868,9 @@ int64_t test(bool fSimple, int64_t cItems, int64_t * aArray)
          expectedValue = fact(initialValue);
       }
 
-      if (aArray[i] != expectedValue) {
-         printf("Error! index:%d value:%d expected:%lld\n", i, aArray[i], expectedValue);
+      int64_t value = loadItem(output, pBuffers->pOutput, i);
+      if (value != expectedValue) {
+         printf("Error! index:%" PRId64 " value:%" PRId64 " expected:%" PRId64 "\n", i, value, expectedValue);
       }
    }
 
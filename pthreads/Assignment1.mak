@@ -20,12 +20,12 @@ endif
 ifeq "$(CFG)" "Debug"
 OUTDIR=Debug
 OUTFILE=$(OUTDIR)/Assignment1
-CFG_INC=
+CFG_INC=-I../common
 CFG_LIB=-lpthread -lrt -lm 
 CFG_OBJ=
-COMMON_OBJ=$(OUTDIR)/Assignment1.o 
+COMMON_OBJ=$(OUTDIR)/Assignment1.o $(OUTDIR)/Schedule.o $(OUTDIR)/Placement.o $(OUTDIR)/Kernels.o $(OUTDIR)/Stats.o $(OUTDIR)/Stream.o 
 OBJ=$(COMMON_OBJ) $(CFG_OBJ)
-ALL_OBJ=$(OUTDIR)/Assignment1.o -lpthread -lrt -lm 
+ALL_OBJ=$(OUTDIR)/Assignment1.o $(OUTDIR)/Schedule.o $(OUTDIR)/Placement.o $(OUTDIR)/Kernels.o $(OUTDIR)/Stats.o $(OUTDIR)/Stream.o -lpthread -lrt -lm 
 
 COMPILE=gcc -c   -g -std=gnu11 -o "$(OUTDIR)/$(*F).o" $(CFG_INC) $<
 LINK=gcc  -g -o "$(OUTFILE)" $(ALL_OBJ)
@@ -61,12 +61,12 @@ endif
 ifeq "$(CFG)" "Release"
 OUTDIR=Release
 OUTFILE=$(OUTDIR)/Assignment1
-CFG_INC=
+CFG_INC=-I../common
 CFG_LIB=-lpthread -lrt -lm 
 CFG_OBJ=
-COMMON_OBJ=$(OUTDIR)/Assignment1.o 
+COMMON_OBJ=$(OUTDIR)/Assignment1.o $(OUTDIR)/Schedule.o $(OUTDIR)/Placement.o $(OUTDIR)/Kernels.o $(OUTDIR)/Stats.o $(OUTDIR)/Stream.o 
 OBJ=$(COMMON_OBJ) $(CFG_OBJ)
-ALL_OBJ=$(OUTDIR)/Assignment1.o -lpthread -lrt -lm 
+ALL_OBJ=$(OUTDIR)/Assignment1.o $(OUTDIR)/Schedule.o $(OUTDIR)/Placement.o $(OUTDIR)/Kernels.o $(OUTDIR)/Stats.o $(OUTDIR)/Stream.o -lpthread -lrt -lm 
 
 COMPILE=gcc -c   -std=gnu11 -o "$(OUTDIR)/$(*F).o" $(CFG_INC) $<
 LINK=gcc  -o "$(OUTFILE)" $(ALL_OBJ)
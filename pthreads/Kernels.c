@@ -0,0 +1,504 @@
+#include <stdio.h>
+#include <string.h>
+#include "Kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+const int64_t g_aFactorial[MAX_TABLE_FACTORIAL + 1] = {
+   1LL,
+   1LL,
+   2LL,
+   6LL,
+   24LL,
+   120LL,
+   720LL,
+   5040LL,
+   40320LL,
+   362880LL,
+   3628800LL,
+   39916800LL,
+   479001600LL,
+   6227020800LL,
+   87178291200LL,
+   1307674368000LL,
+   20922789888000LL,
+   355687428096000LL,
+   6402373705728000LL,
+   121645100408832000LL,
+   2432902008176640000LL,
+};
+
+static const char *s_aNames[KERNEL_COUNT] = { "auto", "scalar", "avx2", "avx512" };
+static const char *s_aStorageNames[STORAGE_COUNT] = { "int64", "int8", "int4" };
+
+// int4 items are unpacked into an int8 scratch block of this many items
+// (small enough to stay in L1) before the int8 kernels run on them
+#define UNPACK_BLOCK 1024
+
+const char *kernelIsaName(KERNEL_ISA isa){
+   return s_aNames[isa];
+}
+
+const char *storageName(STORAGE storage){
+   return s_aStorageNames[storage];
+}
+
+static int parseName(const char *psz, const char **aNames, int cNames){
+   int i;
+   for (i = 0; i < cNames; ++i) {
+      if (0 == strcmp(psz, aNames[i])) {
+         break;
+      }
+   }
+   return i;
+}
+
+KERNEL_ISA parseKernelIsa(const char *psz){
+   return (KERNEL_ISA)parseName(psz, s_aNames, KERNEL_COUNT);
+}
+
+STORAGE parseStorage(const char *psz){
+   return (STORAGE)parseName(psz, s_aStorageNames, STORAGE_COUNT);
+}
+
+int64_t storageBytes(STORAGE storage, int64_t cItems){
+   switch (storage) {
+   case STORAGE_INT8:
+      return cItems;
+   case STORAGE_INT4:
+      return (cItems + 1) / 2;
+   default:
+      return cItems * sizeof(int64_t);
+   }
+}
+
+STORAGE outputStorage(STORAGE storage, bool fSimple){
+   if (!fSimple) {
+      return STORAGE_INT64;
+   }
+   return storage == STORAGE_INT4 ? STORAGE_INT8 : storage;
+}
+
+int64_t loadItem(STORAGE storage, const void *pv, int64_t i){
+   switch (storage) {
+   case STORAGE_INT8:
+      return ((const int8_t*)pv)[i];
+   case STORAGE_INT4:
+      return (((const uint8_t*)pv)[i / 2] >> (4 * (i & 1))) & 0x0f;
+   default:
+      return ((const int64_t*)pv)[i];
+   }
+}
+
+void storeItem(STORAGE storage, void *pv, int64_t i, int64_t value){
+   switch (storage) {
+   case STORAGE_INT8:
+      ((int8_t*)pv)[i] = (int8_t)value;
+      break;
+   case STORAGE_INT4: {
+      uint8_t *pb = &((uint8_t*)pv)[i / 2];
+      int shift = 4 * (i & 1);
+      *pb = (uint8_t)((*pb & ~(0x0f << shift)) | ((value & 0x0f) << shift));
+      break;
+   }
+   default:
+      ((int64_t*)pv)[i] = value;
+      break;
+   }
+}
+
+int64_t tableFact(int64_t x){
+   if (x >= 0 && x <= MAX_TABLE_FACTORIAL) {
+      return g_aFactorial[x];
+   }
+
+   int64_t out = 1;
+   for (int64_t i = x; i > 1; --i) {
+      out *= i;
+   }
+   return out;
+}
+
+//
+// Scalar
+//
+
+static void negate64Scalar(const int64_t *pIn, int64_t *pOut, int64_t n){
+   for (int64_t i = 0; i < n; ++i) {
+      pOut[i] = -pIn[i];
+   }
+}
+
+static void negate8Scalar(const int8_t *pIn, int8_t *pOut, int64_t n){
+   for (int64_t i = 0; i < n; ++i) {
+      pOut[i] = (int8_t)-pIn[i];
+   }
+}
+
+static void factorial64Scalar(const int64_t *pIn, int64_t *pOut, int64_t n){
+   for (int64_t i = 0; i < n; ++i) {
+      pOut[i] = tableFact(pIn[i]);
+   }
+}
+
+static void factorial8Scalar(const int8_t *pIn, int64_t *pOut, int64_t n){
+   for (int64_t i = 0; i < n; ++i) {
+      pOut[i] = tableFact(pIn[i]);
+   }
+}
+
+static void unpack4Scalar(const uint8_t *pIn, int8_t *pOut, int64_t n){
+   for (int64_t k = 0; k < n / 2; ++k) {
+      pOut[2 * k] = pIn[k] & 0x0f;
+      pOut[2 * k + 1] = pIn[k] >> 4;
+   }
+}
+
+#ifdef KERNELS_X86
+
+//
+// AVX2
+//
+
+__attribute__((target("avx2")))
+static void negate64Avx2(const int64_t *pIn, int64_t *pOut, int64_t n){
+   const __m256i zero = _mm256_setzero_si256();
+   int64_t i = 0;
+
+   for (; i + 8 <= n; i += 8) {
+      __m256i a = _mm256_loadu_si256((const __m256i*)&pIn[i]);
+      __m256i b = _mm256_loadu_si256((const __m256i*)&pIn[i + 4]);
+      _mm256_storeu_si256((__m256i*)&pOut[i], _mm256_sub_epi64(zero, a));
+      _mm256_storeu_si256((__m256i*)&pOut[i + 4], _mm256_sub_epi64(zero, b));
+   }
+
+   negate64Scalar(&pIn[i], &pOut[i], n - i);
+}
+
+__attribute__((target("avx2")))
+static void negate8Avx2(const int8_t *pIn, int8_t *pOut, int64_t n){
+   const __m256i zero = _mm256_setzero_si256();
+   int64_t i = 0;
+
+   for (; i + 32 <= n; i += 32) {
+      __m256i a = _mm256_loadu_si256((const __m256i*)&pIn[i]);
+      _mm256_storeu_si256((__m256i*)&pOut[i], _mm256_sub_epi8(zero, a));
+   }
+
+   negate8Scalar(&pIn[i], &pOut[i], n - i);
+}
+
+// Gather x! straight out of g_aFactorial, four lanes at a time.  A vector
+// holding anything outside the table goes through tableFact instead.
+__attribute__((target("avx2")))
+static inline void factorial4Lanes(__m256i x, int64_t *pOut){
+   const __m256i lowest = _mm256_set1_epi64x(-1);
+   const __m256i highest = _mm256_set1_epi64x(MAX_TABLE_FACTORIAL + 1);
+   __m256i fInTable = _mm256_and_si256(_mm256_cmpgt_epi64(x, lowest), _mm256_cmpgt_epi64(highest, x));
+
+   if (_mm256_movemask_epi8(fInTable) == -1) {
+      __m256i f = _mm256_i64gather_epi64((const long long*)g_aFactorial, x, sizeof(int64_t));
+      _mm256_storeu_si256((__m256i*)pOut, f);
+   }
+   else {
+      int64_t ax[4];
+      _mm256_storeu_si256((__m256i*)ax, x);
+      factorial64Scalar(ax, pOut, 4);
+   }
+}
+
+__attribute__((target("avx2")))
+static void factorial64Avx2(const int64_t *pIn, int64_t *pOut, int64_t n){
+   int64_t i = 0;
+
+   for (; i + 4 <= n; i += 4) {
+      factorial4Lanes(_mm256_loadu_si256((const __m256i*)&pIn[i]), &pOut[i]);
+   }
+
+   factorial64Scalar(&pIn[i], &pOut[i], n - i);
+}
+
+__attribute__((target("avx2")))
+static void factorial8Avx2(const int8_t *pIn, int64_t *pOut, int64_t n){
+   int64_t i = 0;
+
+   for (; i + 4 <= n; i += 4) {
+      int32_t packed;
+      memcpy(&packed, &pIn[i], sizeof(packed));
+      factorial4Lanes(_mm256_cvtepi8_epi64(_mm_cvtsi32_si128(packed)), &pOut[i]);
+   }
+
+   factorial8Scalar(&pIn[i], &pOut[i], n - i);
+}
+
+// Widen 16 bytes to 16 x 16 bits, then move each high nibble up into the
+// high byte of its 16 bit lane: in memory order that is item 2k, item 2k+1.
+__attribute__((target("avx2")))
+static void unpack4Avx2(const uint8_t *pIn, int8_t *pOut, int64_t n){
+   const __m256i nibble = _mm256_set1_epi16(0x0f);
+   int64_t i = 0;
+
+   for (; i + 32 <= n; i += 32) {
+      __m256i w = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)&pIn[i / 2]));
+      __m256i lo = _mm256_and_si256(w, nibble);
+      __m256i hi = _mm256_and_si256(_mm256_srli_epi16(w, 4), nibble);
+      _mm256_storeu_si256((__m256i*)&pOut[i], _mm256_or_si256(lo, _mm256_slli_epi16(hi, 8)));
+   }
+
+   unpack4Scalar(&pIn[i / 2], &pOut[i], n - i);
+}
+
+//
+// AVX-512
+//
+
+__attribute__((target("avx512f")))
+static void negate64Avx512(const int64_t *pIn, int64_t *pOut, int64_t n){
+   const __m512i zero = _mm512_setzero_si512();
+   int64_t i = 0;
+
+   for (; i + 16 <= n; i += 16) {
+      __m512i a = _mm512_loadu_si512(&pIn[i]);
+      __m512i b = _mm512_loadu_si512(&pIn[i + 8]);
+      _mm512_storeu_si512(&pOut[i], _mm512_sub_epi64(zero, a));
+      _mm512_storeu_si512(&pOut[i + 8], _mm512_sub_epi64(zero, b));
+   }
+
+   // the tail is at most two masked vectors
+   for (; i < n; i += 8) {
+      __mmask8 m = n - i >= 8 ? 0xff : (__mmask8)((1u << (n - i)) - 1);
+      __m512i a = _mm512_maskz_loadu_epi64(m, &pIn[i]);
+      _mm512_mask_storeu_epi64(&pOut[i], m, _mm512_sub_epi64(zero, a));
+   }
+}
+
+__attribute__((target("avx512bw")))
+static void negate8Avx512(const int8_t *pIn, int8_t *pOut, int64_t n){
+   const __m512i zero = _mm512_setzero_si512();
+   int64_t i = 0;
+
+   for (; i + 64 <= n; i += 64) {
+      __m512i a = _mm512_loadu_si512(&pIn[i]);
+      _mm512_storeu_si512(&pOut[i], _mm512_sub_epi8(zero, a));
+   }
+
+   if (i < n) {
+      __mmask64 m = (__mmask64)((1ull << (n - i)) - 1);
+      __m512i a = _mm512_maskz_loadu_epi8(m, &pIn[i]);
+      _mm512_mask_storeu_epi8(&pOut[i], m, _mm512_sub_epi8(zero, a));
+   }
+}
+
+// The whole table lives in three registers: entries 0..15 come out of a
+// two-register permute, 16..20 out of a one-register permute, so there's
+// no gather (and no memory access) per item at all.
+typedef struct {
+   __m512i t0;
+   __m512i t1;
+   __m512i t2;
+} FACTORIAL_TABLE_512;
+
+__attribute__((target("avx512f")))
+static inline FACTORIAL_TABLE_512 loadFactorialTable512(){
+   FACTORIAL_TABLE_512 table;
+   table.t0 = _mm512_loadu_si512(&g_aFactorial[0]);
+   table.t1 = _mm512_loadu_si512(&g_aFactorial[8]);
+   table.t2 = _mm512_maskz_loadu_epi64(0x1f, &g_aFactorial[16]);
+   return table;
+}
+
+__attribute__((target("avx512f")))
+static inline void factorial8Lanes(const FACTORIAL_TABLE_512 *pTable, __m512i x, int64_t *pOut){
+   // unsigned compare: negative x looks huge and fails the check too
+   if (0 == _mm512_cmpgt_epu64_mask(x, _mm512_set1_epi64(MAX_TABLE_FACTORIAL))) {
+      __m512i f = _mm512_permutex2var_epi64(pTable->t0, x, pTable->t1);
+      __mmask8 fHigh = _mm512_cmpge_epu64_mask(x, _mm512_set1_epi64(16));
+      f = _mm512_mask_permutexvar_epi64(f, fHigh, x, pTable->t2);
+      _mm512_storeu_si512(pOut, f);
+   }
+   else {
+      int64_t ax[8];
+      _mm512_storeu_si512(ax, x);
+      factorial64Scalar(ax, pOut, 8);
+   }
+}
+
+__attribute__((target("avx512f")))
+static void factorial64Avx512(const int64_t *pIn, int64_t *pOut, int64_t n){
+   const FACTORIAL_TABLE_512 table = loadFactorialTable512();
+   int64_t i = 0;
+
+   for (; i + 8 <= n; i += 8) {
+      factorial8Lanes(&table, _mm512_loadu_si512(&pIn[i]), &pOut[i]);
+   }
+
+   factorial64Scalar(&pIn[i], &pOut[i], n - i);
+}
+
+__attribute__((target("avx512f")))
+static void factorial8Avx512(const int8_t *pIn, int64_t *pOut, int64_t n){
+   const FACTORIAL_TABLE_512 table = loadFactorialTable512();
+   int64_t i = 0;
+
+   for (; i + 8 <= n; i += 8) {
+      __m512i x = _mm512_cvtepi8_epi64(_mm_loadl_epi64((const __m128i*)&pIn[i]));
+      factorial8Lanes(&table, x, &pOut[i]);
+   }
+
+   factorial8Scalar(&pIn[i], &pOut[i], n - i);
+}
+
+// Same trick as unpack4Avx2, 64 items at a time
+__attribute__((target("avx512bw")))
+static void unpack4Avx512(const uint8_t *pIn, int8_t *pOut, int64_t n){
+   const __m512i nibble = _mm512_set1_epi16(0x0f);
+   int64_t i = 0;
+
+   for (; i + 64 <= n; i += 64) {
+      __m512i w = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)&pIn[i / 2]));
+      __m512i lo = _mm512_and_si512(w, nibble);
+      __m512i hi = _mm512_and_si512(_mm512_srli_epi16(w, 4), nibble);
+      _mm512_storeu_si512(&pOut[i], _mm512_or_si512(lo, _mm512_slli_epi16(hi, 8)));
+   }
+
+   unpack4Scalar(&pIn[i / 2], &pOut[i], n - i);
+}
+
+#endif // KERNELS_X86
+
+static bool isaSupported(KERNEL_ISA isa, STORAGE storage){
+   switch (isa) {
+   case KERNEL_SCALAR:
+      return true;
+#ifdef KERNELS_X86
+   case KERNEL_AVX2:
+      return __builtin_cpu_supports("avx2");
+   case KERNEL_AVX512:
+      // the byte-wide kernels need the BW extension
+      return __builtin_cpu_supports("avx512f") && (storage == STORAGE_INT64 || __builtin_cpu_supports("avx512bw"));
+#endif
+   default:
+      return false;
+   }
+}
+
+int64_t selectKernels(KERNEL_ISA isa, STORAGE storage, Kernels *pKernels){
+   int64_t iret = 0;
+
+#ifdef KERNELS_X86
+   __builtin_cpu_init();
+#endif
+
+   if (isa == KERNEL_AUTO) {
+      isa = KERNEL_SCALAR;
+      if (isaSupported(KERNEL_AVX512, storage)) {
+         isa = KERNEL_AVX512;
+      }
+      else if (isaSupported(KERNEL_AVX2, storage)) {
+         isa = KERNEL_AVX2;
+      }
+   }
+
+   if (!isaSupported(isa, storage)) {
+      printf("This cpu can't run the %s kernels on %s items.\n", kernelIsaName(isa), storageName(storage));
+      iret = 1;
+   }
+
+   if (0 == iret) {
+      pKernels->isa = isa;
+      pKernels->storage = storage;
+      pKernels->pfnNegate64 = negate64Scalar;
+      pKernels->pfnNegate8 = negate8Scalar;
+      pKernels->pfnFactorial64 = factorial64Scalar;
+      pKernels->pfnFactorial8 = factorial8Scalar;
+      pKernels->pfnUnpack4 = unpack4Scalar;
+
+#ifdef KERNELS_X86
+      if (isa == KERNEL_AVX2) {
+         pKernels->pfnNegate64 = negate64Avx2;
+         pKernels->pfnNegate8 = negate8Avx2;
+         pKernels->pfnFactorial64 = factorial64Avx2;
+         pKernels->pfnFactorial8 = factorial8Avx2;
+         pKernels->pfnUnpack4 = unpack4Avx2;
+      }
+      else if (isa == KERNEL_AVX512) {
+         pKernels->pfnNegate64 = negate64Avx512;
+         pKernels->pfnFactorial64 = factorial64Avx512;
+         pKernels->pfnFactorial8 = factorial8Avx512;
+         if (storage != STORAGE_INT64) {
+            pKernels->pfnNegate8 = negate8Avx512;
+            pKernels->pfnUnpack4 = unpack4Avx512;
+         }
+      }
+#endif
+   }
+
+   return iret;
+}
+
+// int4 input: unpack a block at a time into int8 scratch and run the int8
+// kernel on it.  An odd item at either end is done on its own.
+static void range4(const Kernels *pKernels, const KernelBuffers *pBuffers, bool fNegate, int64_t lo, int64_t hi){
+   int8_t aScratch[UNPACK_BLOCK] __attribute__((aligned(64)));
+   const uint8_t *pIn = (const uint8_t*)pBuffers->pInput;
+   int64_t i = lo;
+
+   while (i < hi) {
+      int64_t n = (hi - i) & ~1LL;
+      if (n > UNPACK_BLOCK) {
+         n = UNPACK_BLOCK;
+      }
+
+      if ((i & 1) || 0 == n) {
+         int64_t x = loadItem(STORAGE_INT4, pIn, i);
+         if (fNegate) {
+            storeItem(STORAGE_INT8, pBuffers->pOutput, i, -x);
+         }
+         else {
+            storeItem(STORAGE_INT64, pBuffers->pOutput, i, tableFact(x));
+         }
+         ++i;
+         continue;
+      }
+
+      pKernels->pfnUnpack4(&pIn[i / 2], aScratch, n);
+      if (fNegate) {
+         pKernels->pfnNegate8(aScratch, &((int8_t*)pBuffers->pOutput)[i], n);
+      }
+      else {
+         pKernels->pfnFactorial8(aScratch, &((int64_t*)pBuffers->pOutput)[i], n);
+      }
+      i += n;
+   }
+}
+
+void negateRange(const Kernels *pKernels, const KernelBuffers *pBuffers, int64_t lo, int64_t hi){
+   switch (pKernels->storage) {
+   case STORAGE_INT8:
+      pKernels->pfnNegate8(&((const int8_t*)pBuffers->pInput)[lo], &((int8_t*)pBuffers->pOutput)[lo], hi - lo);
+      break;
+   case STORAGE_INT4:
+      range4(pKernels, pBuffers, true, lo, hi);
+      break;
+   default:
+      pKernels->pfnNegate64(&((const int64_t*)pBuffers->pInput)[lo], &((int64_t*)pBuffers->pOutput)[lo], hi - lo);
+      break;
+   }
+}
+
+void factorialRange(const Kernels *pKernels, const KernelBuffers *pBuffers, int64_t lo, int64_t hi){
+   switch (pKernels->storage) {
+   case STORAGE_INT8:
+      pKernels->pfnFactorial8(&((const int8_t*)pBuffers->pInput)[lo], &((int64_t*)pBuffers->pOutput)[lo], hi - lo);
+      break;
+   case STORAGE_INT4:
+      range4(pKernels, pBuffers, false, lo, hi);
+      break;
+   default:
+      pKernels->pfnFactorial64(&((const int64_t*)pBuffers->pInput)[lo], &((int64_t*)pBuffers->pOutput)[lo], hi - lo);
+      break;
+   }
+}
@@ -0,0 +1,85 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+// Largest x whose x! still fits in an int64_t
+#define MAX_TABLE_FACTORIAL 20
+
+// Which implementation of the kernels to run
+typedef enum KERNEL_ISA {
+   KERNEL_AUTO,      // the widest one this cpu supports
+   KERNEL_SCALAR,    // plain C, always available
+   KERNEL_AVX2,      // 256 bit vectors
+   KERNEL_AVX512,    // 512 bit vectors
+   KERNEL_COUNT
+} KERNEL_ISA;
+
+// How the items are stored
+typedef enum STORAGE {
+   STORAGE_INT64,    // one int64_t per item
+   STORAGE_INT8,     // one int8_t per item
+   STORAGE_INT4,     // two unsigned 4 bit items per byte, item 2k in the low nibble
+   STORAGE_COUNT
+} STORAGE;
+
+// The arrays a kernel works on.  Kernels that keep the storage type
+// (negation of int64 or int8) run in place and pOutput == pInput.
+typedef struct KernelBuffers {
+
+   // the input items, in the run's STORAGE
+   void *pInput;
+
+   // the results, in outputStorage(storage, fSimple)
+   void *pOutput;
+
+} KernelBuffers;
+
+typedef struct Kernels {
+
+   // the implementation actually picked (never KERNEL_AUTO)
+   KERNEL_ISA isa;
+
+   // how the input is stored
+   STORAGE storage;
+
+   // Building blocks for the picked isa, each over n contiguous items
+   void (*pfnNegate64)(const int64_t *pIn, int64_t *pOut, int64_t n);
+   void (*pfnNegate8)(const int8_t *pIn, int8_t *pOut, int64_t n);
+   void (*pfnFactorial64)(const int64_t *pIn, int64_t *pOut, int64_t n);
+   void (*pfnFactorial8)(const int8_t *pIn, int64_t *pOut, int64_t n);
+   void (*pfnUnpack4)(const uint8_t *pIn, int8_t *pOut, int64_t n);  // n even
+
+} Kernels;
+
+// x! for 0 <= x <= MAX_TABLE_FACTORIAL
+extern const int64_t g_aFactorial[MAX_TABLE_FACTORIAL + 1];
+
+const char *kernelIsaName(KERNEL_ISA isa);
+const char *storageName(STORAGE storage);
+
+// Look up by name; return the *_COUNT value when unknown
+KERNEL_ISA parseKernelIsa(const char *psz);
+STORAGE parseStorage(const char *psz);
+
+// Bytes needed to store cItems items
+int64_t storageBytes(STORAGE storage, int64_t cItems);
+
+// What the results are stored as: negation stays narrow (int4 widens to
+// int8 to make room for the sign), factorial always needs an int64
+STORAGE outputStorage(STORAGE storage, bool fSimple);
+
+// Read / write item i of an array.  Writing an int4 item rewrites the
+// whole byte, so two threads must never write the two halves of one byte.
+int64_t loadItem(STORAGE storage, const void *pv, int64_t i);
+void storeItem(STORAGE storage, void *pv, int64_t i, int64_t value);
+
+// x! from the table when x is in range, by multiplying it out otherwise
+int64_t tableFact(int64_t x);
+
+// Fill in *pKernels with the requested implementation for the given
+// storage, checking with cpuid that this machine can run it.  Returns 0
+// on success.
+int64_t selectKernels(KERNEL_ISA isa, STORAGE storage, Kernels *pKernels);
+
+// Negate / take the factorial of items [lo, hi) of pBuffers
+void negateRange(const Kernels *pKernels, const KernelBuffers *pBuffers, int64_t lo, int64_t hi);
+void factorialRange(const Kernels *pKernels, const KernelBuffers *pBuffers, int64_t lo, int64_t hi);
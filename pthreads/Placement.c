@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "Placement.h"
+
+static const char *s_aAllocNames[ALLOC_COUNT] = { "serial", "parallel" };
+static const char *s_aPageNames[PAGES_COUNT] = { "default", "thp", "huge" };
+static const char *s_aPinNames[PIN_COUNT] = { "none", "core", "node" };
+
+const char *allocPolicyName(ALLOC_POLICY policy){
+   return s_aAllocNames[policy];
+}
+
+const char *pagePolicyName(PAGE_POLICY policy){
+   return s_aPageNames[policy];
+}
+
+const char *pinPolicyName(PIN_POLICY policy){
+   return s_aPinNames[policy];
+}
+
+static int parseName(const char *psz, const char **aNames, int cNames){
+   int i;
+   for (i = 0; i < cNames; ++i) {
+      if (0 == strcmp(psz, aNames[i])) {
+         break;
+      }
+   }
+   return i;
+}
+
+ALLOC_POLICY parseAllocPolicy(const char *psz){
+   return (ALLOC_POLICY)parseName(psz, s_aAllocNames, ALLOC_COUNT);
+}
+
+PAGE_POLICY parsePagePolicy(const char *psz){
+   return (PAGE_POLICY)parseName(psz, s_aPageNames, PAGES_COUNT);
+}
+
+PIN_POLICY parsePinPolicy(const char *psz){
+   return (PIN_POLICY)parseName(psz, s_aPinNames, PIN_COUNT);
+}
+
+static int64_t roundUp(int64_t cb, int64_t cbAlign){
+   return (cb + cbAlign - 1) / cbAlign * cbAlign;
+}
+
+// mmap an untouched, HUGE_PAGE_SIZE aligned region and ask for THP
+static void *allocateTransparentHugePages(int64_t cb){
+   int64_t cbMapped = roundUp(cb, HUGE_PAGE_SIZE) + HUGE_PAGE_SIZE;
+   char *pMapped = mmap(NULL, cbMapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (MAP_FAILED == pMapped) {
+      return NULL;
+   }
+
+   // trim the mapping down to an aligned run of whole huge pages
+   char *pv = (char*)roundUp((int64_t)pMapped, HUGE_PAGE_SIZE);
+   int64_t cbHead = pv - pMapped;
+   int64_t cbTail = cbMapped - cbHead - roundUp(cb, HUGE_PAGE_SIZE);
+   if (cbHead > 0) {
+      munmap(pMapped, cbHead);
+   }
+   if (cbTail > 0) {
+      munmap(pv + roundUp(cb, HUGE_PAGE_SIZE), cbTail);
+   }
+
+#ifdef MADV_HUGEPAGE
+   madvise(pv, roundUp(cb, HUGE_PAGE_SIZE), MADV_HUGEPAGE);
+#endif
+
+   return pv;
+}
+
+int64_t allocatePages(int64_t cb, int64_t cbAlign, PAGE_POLICY *pPages, void **ppv){
+   int64_t iret = 0;
+   void *pv = NULL;
+
+   if (*pPages == PAGES_HUGE) {
+#ifdef MAP_HUGETLB
+      pv = mmap(NULL, roundUp(cb, HUGE_PAGE_SIZE), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (MAP_FAILED == pv) {
+         pv = NULL;
+      }
+#endif
+      if (NULL == pv) {
+         // no huge pages reserved (see /proc/sys/vm/nr_hugepages)
+         *pPages = PAGES_THP;
+      }
+   }
+
+   if (*pPages == PAGES_THP) {
+      pv = allocateTransparentHugePages(cb);
+   }
+
+   if (*pPages == PAGES_DEFAULT) {
+      if (0 != posix_memalign(&pv, cbAlign, cb)) {
+         pv = NULL;
+      }
+   }
+
+   if (NULL == pv) {
+      printf("Out Of Memory in allocatePages\n");
+      iret = 1; // OUT OF MEMORY!
+   }
+
+   *ppv = pv;
+   return iret;
+}
+
+void freePages(void *pv, int64_t cb, PAGE_POLICY pages){
+   if (NULL == pv) {
+      return;
+   }
+
+   if (pages == PAGES_DEFAULT) {
+      free(pv);
+   }
+   else {
+      munmap(pv, roundUp(cb, HUGE_PAGE_SIZE));
+   }
+}
+
+// Read the cpus of numa node 'node' from sysfs.  Returns false if the
+// node doesn't exist.
+static bool readNodeCpus(int node, cpu_set_t *pSet){
+   char szPath[128];
+   snprintf(szPath, sizeof(szPath), "/sys/devices/system/node/node%d/cpulist", node);
+
+   FILE *f = fopen(szPath, "r");
+   if (NULL == f) {
+      return false;
+   }
+
+   // cpulist looks like "0-7,16-23"
+   CPU_ZERO(pSet);
+   int lo = 0;
+   int hi = 0;
+   while (1 == fscanf(f, "%d", &lo)) {
+      hi = lo;
+      int ch = fgetc(f);
+      if (ch == '-') {
+         if (1 != fscanf(f, "%d", &hi)) {
+            break;
+         }
+         ch = fgetc(f);
+      }
+      for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; ++cpu) {
+         CPU_SET(cpu, pSet);
+      }
+      if (ch != ',') {
+         break;
+      }
+   }
+
+   fclose(f);
+   return true;
+}
+
+int64_t pinThread(PIN_POLICY policy, int64_t myThreadId){
+   int64_t iret = 0;
+   cpu_set_t allowed;
+   cpu_set_t mine;
+
+   if (policy == PIN_NONE) {
+      return 0;
+   }
+
+   // only ever narrow down the cpus we were started with
+   iret = sched_getaffinity(0, sizeof(allowed), &allowed);
+   CPU_ZERO(&mine);
+
+   if (0 == iret && policy == PIN_CORE) {
+      int64_t cAllowed = CPU_COUNT(&allowed);
+      int64_t target = myThreadId % cAllowed;
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+         if (CPU_ISSET(cpu, &allowed) && 0 == target--) {
+            CPU_SET(cpu, &mine);
+            break;
+         }
+      }
+   }
+
+   if (0 == iret && policy == PIN_NODE) {
+      int cNodes = 0;
+      cpu_set_t node;
+      while (readNodeCpus(cNodes, &node)) {
+         ++cNodes;
+      }
+
+      if (cNodes > 0 && readNodeCpus(myThreadId % cNodes, &node)) {
+         CPU_AND(&mine, &node, &allowed);
+      }
+
+      // no numa information: the whole machine is one node
+      if (0 == CPU_COUNT(&mine)) {
+         CPU_OR(&mine, &allowed, &allowed);
+      }
+   }
+
+   if (0 == iret) {
+      iret = sched_setaffinity(0, sizeof(mine), &mine);
+   }
+
+   if (0 != iret) {
+      printf("Failed to pin thread %ld!\n", (long)myThreadId);
+   }
+
+   return iret;
+}
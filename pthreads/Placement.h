@@ -0,0 +1,49 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+// Size of the huge pages asked for by PAGES_THP and PAGES_HUGE
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Who touches the pages of the array first
+typedef enum ALLOC_POLICY {
+   ALLOC_SERIAL,     // the main thread initializes everything
+   ALLOC_PARALLEL,   // each worker initializes the part it will compute on
+   ALLOC_COUNT
+} ALLOC_POLICY;
+
+// What backs the array
+typedef enum PAGE_POLICY {
+   PAGES_DEFAULT,    // whatever malloc hands out
+   PAGES_THP,        // 2MB aligned mmap with madvise(MADV_HUGEPAGE)
+   PAGES_HUGE,       // explicit MAP_HUGETLB pages, falls back to PAGES_THP
+   PAGES_COUNT
+} PAGE_POLICY;
+
+// Where the workers are allowed to run
+typedef enum PIN_POLICY {
+   PIN_NONE,         // anywhere the scheduler likes
+   PIN_CORE,         // worker i on the i'th allowed cpu
+   PIN_NODE,         // worker i on any cpu of numa node i % #nodes
+   PIN_COUNT
+} PIN_POLICY;
+
+const char *allocPolicyName(ALLOC_POLICY policy);
+const char *pagePolicyName(PAGE_POLICY policy);
+const char *pinPolicyName(PIN_POLICY policy);
+
+// Look up a policy by name; return the *_COUNT value when unknown
+ALLOC_POLICY parseAllocPolicy(const char *psz);
+PAGE_POLICY parsePagePolicy(const char *psz);
+PIN_POLICY parsePinPolicy(const char *psz);
+
+// Allocate cb bytes aligned to at least cbAlign without touching them.
+// *pPages is updated to the policy that was actually used.  Returns 0 on
+// success.
+int64_t allocatePages(int64_t cb, int64_t cbAlign, PAGE_POLICY *pPages, void **ppv);
+
+// Release memory from allocatePages (pages is the policy it reported)
+void freePages(void *pv, int64_t cb, PAGE_POLICY pages);
+
+// Restrict the calling thread according to policy.  myThreadId picks the
+// core or node.  Returns 0 on success.
+int64_t pinThread(PIN_POLICY policy, int64_t myThreadId);
@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "Schedule.h"
+
+typedef struct {
+   const char *name;
+   const char *abbreviation;
+} SCHEDULE_NAME;
+
+static const SCHEDULE_NAME s_aNames[SCHEDULE_COUNT] = {
+   { "block",    "b" },
+   { "cyclic",   "c" },
+   { "block-cyclic", "bc" },
+   { "dynamic",  "d" },
+   { "guided",   "g" },
+   { "stealing", "s" },
+};
+
+int64_t cacheLineSize(){
+   int64_t cb = 0;
+
+#ifdef _SC_LEVEL1_DCACHE_LINESIZE
+   cb = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+#endif
+
+   if (cb <= 0) {
+      FILE *f = fopen("/sys/devices/system/cpu/cpu0/cache/index0/coherency_line_size", "r");
+      if (NULL != f) {
+         long cbFile = 0;
+         if (1 == fscanf(f, "%ld", &cbFile)) {
+            cb = cbFile;
+         }
+         fclose(f);
+      }
+   }
+
+   // anything that isn't a sane power of two gets the default
+   if (cb < (int64_t)sizeof(int64_t) || (cb & (cb - 1)) != 0) {
+      cb = CACHE_LINE_SIZE;
+   }
+
+   return cb;
+}
+
+const char *scheduleName(SCHEDULE schedule){
+   return s_aNames[schedule].name;
+}
+
+SCHEDULE parseSchedule(const char *psz){
+   // exact names and abbreviations first ...
+   for (int i = 0; i < SCHEDULE_COUNT; ++i) {
+      if (0 == strcmp(psz, s_aNames[i].name) || 0 == strcmp(psz, s_aNames[i].abbreviation)) {
+         return (SCHEDULE)i;
+      }
+   }
+
+   // ... then any prefix of a name, so "cyc" still means cyclic
+   size_t cch = strlen(psz);
+   for (int i = 0; cch > 0 && i < SCHEDULE_COUNT; ++i) {
+      if (0 == strncmp(psz, s_aNames[i].name, cch)) {
+         return (SCHEDULE)i;
+      }
+   }
+
+   return SCHEDULE_COUNT;
+}
+
+bool isChunkedSchedule(SCHEDULE schedule){
+   return schedule != SCHEDULE_BLOCK && schedule != SCHEDULE_CYCLIC;
+}
+
+int64_t createSchedule(SCHEDULE schedule, int64_t numItems, int64_t numTasks, int64_t chunk, ScheduleState *pState){
+   int64_t iret = 0;
+
+   pState->schedule = schedule;
+   pState->numItems = numItems;
+   pState->numTasks = numTasks;
+   pState->chunk = chunk;
+   pState->aDeques = NULL;
+   pState->cChunks = (numItems + chunk - 1) / chunk;
+   atomic_init(&pState->next, 0);
+
+   if (schedule == SCHEDULE_STEALING) {
+      if (0 != posix_memalign((void**)&pState->aDeques, 64, numTasks * sizeof(ScheduleDeque))) {
+         printf("Out of memory allocating deques!\n");
+         pState->aDeques = NULL;
+         iret = 1; // out of memory
+      }
+
+      if (0 == iret) {
+         for (int64_t i = 0; i < numTasks; ++i) {
+            pthread_mutex_init(&pState->aDeques[i].lock, NULL);
+         }
+      }
+   }
+
+   if (0 == iret) {
+      resetSchedule(pState);
+   }
+
+   return iret;
+}
+
+void resetSchedule(ScheduleState *pState){
+   atomic_store(&pState->next, 0);
+
+   if (NULL != pState->aDeques) {
+      // every thread starts out owning a block of the chunks
+      for (int64_t i = 0; i < pState->numTasks; ++i) {
+         computeMyBlockPart(pState->cChunks, pState->numTasks, i, &pState->aDeques[i].lo, &pState->aDeques[i].hi);
+      }
+   }
+}
+
+void resizeSchedule(ScheduleState *pState, int64_t numItems){
+   pState->numItems = numItems;
+   pState->cChunks = (numItems + pState->chunk - 1) / pState->chunk;
+   resetSchedule(pState);
+}
+
+static bool nextDynamicChunk(ScheduleState *pState, int64_t *myLo, int64_t *myHi){
+   int64_t lo = atomic_fetch_add(&pState->next, pState->chunk);
+   if (lo >= pState->numItems) {
+      return false;
+   }
+
+   *myLo = lo;
+   *myHi = lo + pState->chunk < pState->numItems ? lo + pState->chunk : pState->numItems;
+   return true;
+}
+
+static bool nextGuidedChunk(ScheduleState *pState, int64_t *myLo, int64_t *myHi){
+   int64_t lo = atomic_load(&pState->next);
+   int64_t size;
+
+   do {
+      int64_t remaining = pState->numItems - lo;
+      if (remaining <= 0) {
+         return false;
+      }
+
+      // each claim takes a share of what's left, like OpenMP's guided
+      size = remaining / (2 * pState->numTasks);
+      if (size < pState->chunk) {
+         size = pState->chunk;
+      }
+      if (size > remaining) {
+         size = remaining;
+      }
+   } while (!atomic_compare_exchange_weak(&pState->next, &lo, lo + size));
+
+   *myLo = lo;
+   *myHi = lo + size;
+   return true;
+}
+
+// Move half of a victim's remaining chunks (at least one) into our deque.
+static bool stealChunks(ScheduleState *pState, int64_t myTaskId){
+   for (int64_t k = 1; k < pState->numTasks; ++k) {
+      ScheduleDeque *pVictim = &pState->aDeques[(myTaskId + k) % pState->numTasks];
+      int64_t lo = 0;
+      int64_t hi = 0;
+
+      pthread_mutex_lock(&pVictim->lock);
+      int64_t cAvailable = pVictim->hi - pVictim->lo;
+      if (cAvailable > 0) {
+         int64_t cSteal = (cAvailable + 1) / 2;
+         hi = pVictim->hi;
+         lo = hi - cSteal;
+         pVictim->hi = lo;
+      }
+      pthread_mutex_unlock(&pVictim->lock);
+
+      if (hi > lo) {
+         ScheduleDeque *pMine = &pState->aDeques[myTaskId];
+         pthread_mutex_lock(&pMine->lock);
+         pMine->lo = lo;
+         pMine->hi = hi;
+         pthread_mutex_unlock(&pMine->lock);
+         return true;
+      }
+   }
+
+   return false;
+}
+
+static bool nextStolenChunk(ScheduleState *pState, int64_t myTaskId, int64_t *myLo, int64_t *myHi){
+   ScheduleDeque *pMine = &pState->aDeques[myTaskId];
+
+   for (;;) {
+      int64_t chunk = -1;
+
+      pthread_mutex_lock(&pMine->lock);
+      if (pMine->lo < pMine->hi) {
+         chunk = pMine->lo++;
+      }
+      pthread_mutex_unlock(&pMine->lock);
+
+      if (chunk >= 0) {
+         *myLo = chunk * pState->chunk;
+         *myHi = *myLo + pState->chunk < pState->numItems ? *myLo + pState->chunk : pState->numItems;
+         return true;
+      }
+
+      // Chunks are never handed back, so once every deque has been
+      // seen empty there is nothing left to do.
+      if (!stealChunks(pState, myTaskId)) {
+         return false;
+      }
+   }
+}
+
+bool nextChunk(ScheduleState *pState, int64_t myTaskId, int64_t *myLo, int64_t *myHi){
+   switch (pState->schedule) {
+   case SCHEDULE_DYNAMIC:
+      return nextDynamicChunk(pState, myLo, myHi);
+   case SCHEDULE_GUIDED:
+      return nextGuidedChunk(pState, myLo, myHi);
+   case SCHEDULE_STEALING:
+      return nextStolenChunk(pState, myTaskId, myLo, myHi);
+   default:
+      return false;
+   }
+}
+
+void destroySchedule(ScheduleState *pState){
+   if (NULL != pState->aDeques) {
+      for (int64_t i = 0; i < pState->numTasks; ++i) {
+         pthread_mutex_destroy(&pState->aDeques[i].lock);
+      }
+      free(pState->aDeques);
+      pState->aDeques = NULL;
+   }
+}
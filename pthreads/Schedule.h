@@ -0,0 +1,74 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "Partition.h"   // computeMyBlockPart & co., shared with the other programs
+
+// Cache line size assumed when it can't be detected
+#define CACHE_LINE_SIZE 64
+
+// How the items are handed out to the worker threads
+typedef enum SCHEDULE {
+   SCHEDULE_BLOCK,     // one contiguous block per thread (computeMyBlockPart)
+   SCHEDULE_CYCLIC,    // thread t takes t, t+T, t+2T, ... (computeMyCyclicPart)
+   SCHEDULE_BLOCK_CYCLIC, // thread t takes chunks t, t+T, t+2T, ... (computeMyBlockCyclicPart)
+   SCHEDULE_DYNAMIC,   // fixed size chunks claimed from a shared counter
+   SCHEDULE_GUIDED,    // chunks shrink with the remaining work, never below the chunk size
+   SCHEDULE_STEALING,  // per-thread deques of chunks; idle threads steal from the others
+   SCHEDULE_COUNT
+} SCHEDULE;
+
+// Size in bytes of a cache line on this machine, CACHE_LINE_SIZE if unknown
+int64_t cacheLineSize();
+
+// One work-stealing deque: the chunks [lo, hi) still owned by a thread.
+// The owner takes from lo, thieves take from hi.  Padded out to its own
+// cache line so the owners don't fight over each other's deques.
+typedef struct ScheduleDeque {
+   pthread_mutex_t lock;
+   int64_t lo;
+   int64_t hi;
+} __attribute__((aligned(64))) ScheduleDeque;
+
+typedef struct ScheduleState {
+
+   SCHEDULE schedule;
+   int64_t numItems;
+   int64_t numTasks;
+
+   // dynamic, block-cyclic & stealing: items per chunk; guided: smallest chunk
+   int64_t chunk;
+
+   // dynamic & guided: first item nobody has claimed yet
+   _Atomic int64_t next __attribute__((aligned(64)));
+
+   // stealing: one deque per thread, holding chunk indices
+   ScheduleDeque *aDeques;
+   int64_t cChunks;
+
+} ScheduleState;
+
+// Name used on the command line and in the CSV output
+const char *scheduleName(SCHEDULE schedule);
+
+// Look up a schedule by name or abbreviation; returns SCHEDULE_COUNT when unknown
+SCHEDULE parseSchedule(const char *psz);
+
+// True for the schedules that cut the work up by the chunk size
+bool isChunkedSchedule(SCHEDULE schedule);
+
+// Set up the shared state for a run.  Returns 0 on success.
+int64_t createSchedule(SCHEDULE schedule, int64_t numItems, int64_t numTasks, int64_t chunk, ScheduleState *pState);
+
+// Hand every item out again; call between runs.
+void resetSchedule(ScheduleState *pState);
+
+// Hand out numItems items from now on (no more than createSchedule got),
+// starting over like resetSchedule
+void resizeSchedule(ScheduleState *pState, int64_t numItems);
+
+// Claim the next chunk [*myLo, *myHi) for myTaskId.  Returns false once
+// there is no work left anywhere.
+bool nextChunk(ScheduleState *pState, int64_t myTaskId, int64_t *myLo, int64_t *myHi);
+
+void destroySchedule(ScheduleState *pState);
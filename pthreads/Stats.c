@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "Timer.h"
+#include "Stats.h"
+
+static const char *s_aFormatNames[STATS_COUNT] = { "none", "text", "json" };
+static const char *s_aCounterNames[COUNTER_COUNT] = { "cycles", "instructions", "llc_misses" };
+
+static const uint64_t s_aCounterConfigs[COUNTER_COUNT] = {
+   PERF_COUNT_HW_CPU_CYCLES,
+   PERF_COUNT_HW_INSTRUCTIONS,
+   PERF_COUNT_HW_CACHE_MISSES,    // last level cache misses
+};
+
+const char *statsFormatName(STATS_FORMAT format){
+   return s_aFormatNames[format];
+}
+
+STATS_FORMAT parseStatsFormat(const char *psz){
+   int i;
+   for (i = 0; i < STATS_COUNT; ++i) {
+      if (0 == strcmp(psz, s_aFormatNames[i])) {
+         break;
+      }
+   }
+   return (STATS_FORMAT)i;
+}
+
+void openCounters(ThreadCounters *pCounters){
+   for (int c = 0; c < COUNTER_COUNT; ++c) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = s_aCounterConfigs[c];
+      // user space only, so it works with perf_event_paranoid == 2
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+
+      // this thread, on whatever cpu it runs
+      pCounters->aFd[c] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+   }
+}
+
+void closeCounters(ThreadCounters *pCounters){
+   for (int c = 0; c < COUNTER_COUNT; ++c) {
+      if (pCounters->aFd[c] >= 0) {
+         close(pCounters->aFd[c]);
+      }
+      pCounters->aFd[c] = -1;
+   }
+}
+
+static int64_t readCounter(int fd){
+   uint64_t count = 0;
+   if (fd < 0 || sizeof(count) != read(fd, &count, sizeof(count))) {
+      return 0;
+   }
+   return (int64_t)count;
+}
+
+void beginSample(const ThreadCounters *pCounters, ThreadSample *pSample){
+   pSample->cItems = 0;
+   for (int c = 0; c < COUNTER_COUNT; ++c) {
+      pSample->aCounts[c] = readCounter(pCounters->aFd[c]);
+   }
+   pSample->tStart = nowNs();
+}
+
+void endSample(const ThreadCounters *pCounters, ThreadSample *pSample){
+   pSample->tEnd = nowNs();
+   for (int c = 0; c < COUNTER_COUNT; ++c) {
+      pSample->aCounts[c] = pCounters->aFd[c] < 0 ? -1 : readCounter(pCounters->aFd[c]) - pSample->aCounts[c];
+   }
+}
+
+void addSample(ThreadStats *pStats, const ThreadSample *pSample, int64_t tRunStart){
+   pStats->tStartDelay += pSample->tStart - tRunStart;
+   pStats->tBusy += pSample->tEnd - pSample->tStart;
+   pStats->cItems += pSample->cItems;
+   for (int c = 0; c < COUNTER_COUNT; ++c) {
+      if (pStats->aCounts[c] >= 0) {
+         pStats->aCounts[c] = pSample->aCounts[c] < 0 ? -1 : pStats->aCounts[c] + pSample->aCounts[c];
+      }
+   }
+}
+
+void printStats(STATS_FORMAT format, const ThreadStats *aStats, int64_t cThreads, int64_t cRepeat, int64_t tWall){
+   if (format == STATS_NONE) {
+      return;
+   }
+
+   // a counter only means something if every thread got it
+   bool afCounter[COUNTER_COUNT];
+   for (int c = 0; c < COUNTER_COUNT; ++c) {
+      afCounter[c] = true;
+      for (int64_t t = 0; t < cThreads; ++t) {
+         afCounter[c] = afCounter[c] && aStats[t].aCounts[c] >= 0;
+      }
+   }
+
+   int64_t tMaxBusy = 0;
+   int64_t tSumBusy = 0;
+   for (int64_t t = 0; t < cThreads; ++t) {
+      tSumBusy += aStats[t].tBusy;
+      if (aStats[t].tBusy > tMaxBusy) {
+         tMaxBusy = aStats[t].tBusy;
+      }
+   }
+
+   // 1.0 is perfect balance; idle is the share of thread time not spent busy
+   double meanBusy = (double)tSumBusy / cThreads;
+   double imbalance = meanBusy > 0 ? tMaxBusy / meanBusy : 1.0;
+   double idle = tWall > 0 ? 1.0 - (double)tSumBusy / ((double)cThreads * tWall) : 0.0;
+   if (idle < 0) {
+      idle = 0;
+   }
+
+   if (format == STATS_TEXT) {
+      printf("thread, start_us, busy_us, items");
+      for (int c = 0; c < COUNTER_COUNT; ++c) {
+         printf(", %s", s_aCounterNames[c]);
+      }
+      printf(", ipc\n");
+
+      for (int64_t t = 0; t < cThreads; ++t) {
+         const ThreadStats *p = &aStats[t];
+         printf("%" PRId64 ", %.3f, %.3f, %" PRId64, t,
+                p->tStartDelay / 1e3 / cRepeat, p->tBusy / 1e3 / cRepeat, p->cItems / cRepeat);
+         for (int c = 0; c < COUNTER_COUNT; ++c) {
+            if (afCounter[c]) {
+               printf(", %" PRId64, p->aCounts[c] / cRepeat);
+            }
+            else {
+               printf(", n/a");
+            }
+         }
+         if (afCounter[COUNTER_CYCLES] && afCounter[COUNTER_INSTRUCTIONS] && p->aCounts[COUNTER_CYCLES] > 0) {
+            printf(", %.3f\n", (double)p->aCounts[COUNTER_INSTRUCTIONS] / p->aCounts[COUNTER_CYCLES]);
+         }
+         else {
+            printf(", n/a\n");
+         }
+      }
+
+      printf("wall_us: %.3f, max_busy_us: %.3f, mean_busy_us: %.3f, max/mean: %.3f, idle: %.3f\n",
+             tWall / 1e3 / cRepeat, tMaxBusy / 1e3 / cRepeat, meanBusy / 1e3 / cRepeat, imbalance, idle);
+   }
+   else {
+      printf("{\"repeats\": %" PRId64 ", \"wall_us\": %.3f, \"max_busy_us\": %.3f, \"mean_busy_us\": %.3f, "
+             "\"max_over_mean\": %.4f, \"idle_fraction\": %.4f, \"threads\": [",
+             cRepeat, tWall / 1e3 / cRepeat, tMaxBusy / 1e3 / cRepeat, meanBusy / 1e3 / cRepeat, imbalance, idle);
+
+      for (int64_t t = 0; t < cThreads; ++t) {
+         const ThreadStats *p = &aStats[t];
+         printf("%s{\"thread\": %" PRId64 ", \"start_us\": %.3f, \"busy_us\": %.3f, \"items\": %" PRId64,
+                t > 0 ? ", " : "", t, p->tStartDelay / 1e3 / cRepeat, p->tBusy / 1e3 / cRepeat, p->cItems / cRepeat);
+         for (int c = 0; c < COUNTER_COUNT; ++c) {
+            if (afCounter[c]) {
+               printf(", \"%s\": %" PRId64, s_aCounterNames[c], p->aCounts[c] / cRepeat);
+            }
+            else {
+               printf(", \"%s\": null", s_aCounterNames[c]);
+            }
+         }
+         printf("}");
+      }
+      printf("]}\n");
+   }
+}
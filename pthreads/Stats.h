@@ -0,0 +1,72 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+// How --stats reports the per-thread numbers
+typedef enum STATS_FORMAT {
+   STATS_NONE,       // just the CSV line
+   STATS_TEXT,       // a table after the CSV line
+   STATS_JSON,       // one JSON object after the CSV line
+   STATS_COUNT
+} STATS_FORMAT;
+
+// The hardware counters read around each worker's part
+typedef enum COUNTER {
+   COUNTER_CYCLES,
+   COUNTER_INSTRUCTIONS,
+   COUNTER_LLC_MISSES,
+   COUNTER_COUNT
+} COUNTER;
+
+// perf_event file descriptors of one worker thread (-1 when unavailable)
+typedef struct ThreadCounters {
+
+   int aFd[COUNTER_COUNT];
+
+} ThreadCounters;
+
+// What one worker did during one run
+typedef struct ThreadSample {
+
+   // CLOCK_MONOTONIC nanoseconds when the worker started / finished its part
+   int64_t tStart;
+   int64_t tEnd;
+
+   // items the worker processed
+   int64_t cItems;
+
+   // counter deltas over [tStart, tEnd], -1 for a counter we don't have;
+   // at the start, the raw readings
+   int64_t aCounts[COUNTER_COUNT];
+
+} ThreadSample;
+
+// One worker's samples summed over all the runs
+typedef struct ThreadStats {
+
+   int64_t tStartDelay;   // from the caller starting the run to the worker starting
+   int64_t tBusy;         // from the worker starting to the worker finishing
+   int64_t cItems;
+   int64_t aCounts[COUNTER_COUNT];   // -1 once any run lacked the counter
+
+} ThreadStats;
+
+const char *statsFormatName(STATS_FORMAT format);
+
+// Look up by name; return STATS_COUNT when unknown
+STATS_FORMAT parseStatsFormat(const char *psz);
+
+// Open the counters for the calling thread.  A counter the kernel won't
+// give us (see /proc/sys/kernel/perf_event_paranoid) is left at -1.
+void openCounters(ThreadCounters *pCounters);
+void closeCounters(ThreadCounters *pCounters);
+
+// Bracket a worker's part of a run, on the worker thread
+void beginSample(const ThreadCounters *pCounters, ThreadSample *pSample);
+void endSample(const ThreadCounters *pCounters, ThreadSample *pSample);
+
+// Add a finished sample of a run the caller started at tRunStart
+void addSample(ThreadStats *pStats, const ThreadSample *pSample, int64_t tRunStart);
+
+// Print the per-thread table and the imbalance metrics as per-run means.
+// tWall is the summed wall clock time of the cRepeat runs.
+void printStats(STATS_FORMAT format, const ThreadStats *aStats, int64_t cThreads, int64_t cRepeat, int64_t tWall);
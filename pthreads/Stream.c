@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Kernels.h"
+#include "Stream.h"
+
+static const char *s_aIoNames[IO_COUNT] = { "memory", "mmap", "pread" };
+
+const char *ioModeName(IO_MODE io){
+   return s_aIoNames[io];
+}
+
+IO_MODE parseIoMode(const char *psz){
+   int i;
+   for (i = 0; i < IO_COUNT; ++i) {
+      if (0 == strcmp(psz, s_aIoNames[i])) {
+         break;
+      }
+   }
+   return (IO_MODE)i;
+}
+
+int64_t roundWindow(int64_t cWindow){
+   // two int4 items per byte, so 2 * page items is a whole page in any storage
+   int64_t cAlign = 2 * sysconf(_SC_PAGESIZE);
+   return (cWindow + cAlign - 1) / cAlign * cAlign;
+}
+
+// Byte range of window i in a file stored as storage
+static int64_t windowOffset(const Stream *pStream, STORAGE storage, int64_t i){
+   return storageBytes(storage, i * pStream->cWindow);
+}
+
+static int64_t windowBytes(const Stream *pStream, STORAGE storage, int64_t i){
+   int64_t lo = i * pStream->cWindow;
+   int64_t hi = lo + pStream->cWindow < pStream->cItems ? lo + pStream->cWindow : pStream->cItems;
+   return storageBytes(storage, hi) - storageBytes(storage, lo);
+}
+
+static bool readFully(int fd, void *pv, int64_t cb, int64_t offset){
+   while (cb > 0) {
+      ssize_t cbRead = pread(fd, pv, cb, offset);
+      if (cbRead <= 0) {
+         return false;
+      }
+      pv = (char*)pv + cbRead;
+      offset += cbRead;
+      cb -= cbRead;
+   }
+   return true;
+}
+
+static bool writeFully(int fd, const void *pv, int64_t cb, int64_t offset){
+   while (cb > 0) {
+      ssize_t cbWritten = pwrite(fd, pv, cb, offset);
+      if (cbWritten <= 0) {
+         return false;
+      }
+      pv = (const char*)pv + cbWritten;
+      offset += cbWritten;
+      cb -= cbWritten;
+   }
+   return true;
+}
+
+// The background transfer: write back the finished window, then reuse its
+// buffer for the next one.  In that order, since they share a buffer.
+static void *IoThreadProc(void *ptr){
+   Stream *pStream = (Stream*)ptr;
+
+   if (pStream->iWrite >= 0) {
+      int64_t i = pStream->iWrite;
+      if (!writeFully(pStream->fdOut, pStream->aOut[i & 1], windowBytes(pStream, pStream->outputStorage, i), windowOffset(pStream, pStream->outputStorage, i))) {
+         printf("Failed to write the output file!\n");
+         pStream->iret = 1;
+      }
+   }
+
+   if (pStream->iRead >= 0 && 0 == pStream->iret) {
+      int64_t i = pStream->iRead;
+      if (!readFully(pStream->fdIn, pStream->aIn[i & 1], windowBytes(pStream, pStream->storage, i), windowOffset(pStream, pStream->storage, i))) {
+         printf("Failed to read the input file!\n");
+         pStream->iret = 1;
+      }
+   }
+
+   return NULL;
+}
+
+static void startIo(Stream *pStream, int64_t iWrite, int64_t iRead){
+   pStream->iWrite = iWrite;
+   pStream->iRead = iRead;
+   if (0 == pthread_create(&pStream->ioThread, NULL, IoThreadProc, pStream)) {
+      pStream->fIoThread = true;
+   }
+   else {
+      // no thread to spare: do it now
+      IoThreadProc(pStream);
+   }
+}
+
+static void waitIo(Stream *pStream){
+   if (pStream->fIoThread) {
+      pthread_join(pStream->ioThread, NULL);
+      pStream->fIoThread = false;
+   }
+}
+
+int64_t openStream(IO_MODE io, const char *pszInput, const char *pszOutput, STORAGE storage, STORAGE outputStorage, int64_t cItems, int64_t cWindow, Stream *pStream){
+   int64_t iret = 0;
+   struct stat st;
+   bool fInPlace = storage == outputStorage;
+   int64_t cbIn = storageBytes(storage, cItems);
+   int64_t cbOut = storageBytes(outputStorage, cItems);
+
+   memset(pStream, 0, sizeof(*pStream));
+   pStream->io = io;
+   pStream->storage = storage;
+   pStream->outputStorage = outputStorage;
+   pStream->cItems = cItems;
+   pStream->cWindow = roundWindow(cWindow);
+   pStream->cWindows = (cItems + pStream->cWindow - 1) / pStream->cWindow;
+   pStream->fdOut = -1;
+   pStream->iWrite = -1;
+   pStream->iRead = -1;
+
+   pStream->fdIn = open(pszInput, O_RDONLY);
+   if (pStream->fdIn < 0) {
+      printf("Can't open input file %s\n", pszInput);
+      iret = 1;
+   }
+
+   if (0 == iret && (0 != fstat(pStream->fdIn, &st) || st.st_size < cbIn)) {
+      printf("Input file %s holds fewer than %lld items\n", pszInput, (long long)cItems);
+      iret = 1;
+   }
+
+   if (0 == iret) {
+      pStream->fdOut = open(pszOutput, O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (pStream->fdOut < 0 || 0 != ftruncate(pStream->fdOut, cbOut)) {
+         printf("Can't create output file %s\n", pszOutput);
+         iret = 1;
+      }
+   }
+
+   if (0 == iret && io == IO_MMAP) {
+      pStream->pMapIn = mmap(NULL, cbIn, PROT_READ, MAP_SHARED, pStream->fdIn, 0);
+      pStream->pMapOut = mmap(NULL, cbOut, PROT_READ | PROT_WRITE, MAP_SHARED, pStream->fdOut, 0);
+      if (MAP_FAILED == pStream->pMapIn || MAP_FAILED == pStream->pMapOut) {
+         printf("Failed to map the files!\n");
+         iret = 1;
+      }
+      else {
+         madvise(pStream->pMapIn, cbIn, MADV_SEQUENTIAL);
+      }
+   }
+
+   if (0 == iret && io == IO_PREAD) {
+      for (int b = 0; 0 == iret && b < 2; ++b) {
+         if (0 != posix_memalign(&pStream->aIn[b], 64, storageBytes(storage, pStream->cWindow))) {
+            pStream->aIn[b] = NULL;
+            iret = 1;
+         }
+         else if (fInPlace) {
+            pStream->aOut[b] = pStream->aIn[b];
+         }
+         else if (0 != posix_memalign(&pStream->aOut[b], 64, storageBytes(outputStorage, pStream->cWindow))) {
+            pStream->aOut[b] = NULL;
+            iret = 1;
+         }
+      }
+      if (0 != iret) {
+         printf("Out of memory allocating the window buffers!\n");
+      }
+   }
+
+   if (0 == iret && io == IO_PREAD) {
+      startIo(pStream, -1, 0);
+   }
+
+   if (0 != iret) {
+      pStream->iret = iret;
+      closeStream(pStream);
+   }
+
+   return iret;
+}
+
+// IO_MMAP: the window is done; its pages can go once the results are on their way
+static void releaseMappedWindow(Stream *pStream, int64_t i){
+   int64_t cbOut = windowBytes(pStream, pStream->outputStorage, i);
+   uint8_t *pOut = pStream->pMapOut + windowOffset(pStream, pStream->outputStorage, i);
+
+   // dirty shared pages stay in the page cache, so nothing is lost
+   msync(pOut, cbOut, MS_ASYNC);
+   madvise(pOut, cbOut, MADV_DONTNEED);
+   madvise(pStream->pMapIn + windowOffset(pStream, pStream->storage, i), windowBytes(pStream, pStream->storage, i), MADV_DONTNEED);
+}
+
+bool nextWindow(Stream *pStream, StreamWindow *pWindow){
+   int64_t i = pStream->iWindow;
+
+   if (pStream->io == IO_PREAD) {
+      waitIo(pStream);
+   }
+
+   if (0 != pStream->iret || i > pStream->cWindows) {
+      return false;
+   }
+
+   pStream->iWindow++;
+
+   if (pStream->io == IO_MMAP) {
+      if (i > 0) {
+         releaseMappedWindow(pStream, i - 1);
+      }
+      if (i + 1 < pStream->cWindows) {
+         madvise(pStream->pMapIn + windowOffset(pStream, pStream->storage, i + 1), windowBytes(pStream, pStream->storage, i + 1), MADV_WILLNEED);
+      }
+   }
+
+   if (i == pStream->cWindows) {
+      // all done: the last window still has to go out
+      if (pStream->io == IO_PREAD && i > 0) {
+         pStream->iWrite = i - 1;
+         pStream->iRead = -1;
+         IoThreadProc(pStream);
+      }
+      return false;
+   }
+
+   if (pStream->io == IO_PREAD) {
+      startIo(pStream, i - 1, i + 1 < pStream->cWindows ? i + 1 : -1);
+   }
+
+   pWindow->lo = i * pStream->cWindow;
+   pWindow->cItems = pStream->cItems - pWindow->lo < pStream->cWindow ? pStream->cItems - pWindow->lo : pStream->cWindow;
+
+   if (pStream->io == IO_MMAP) {
+      pWindow->buffers.pInput = pStream->pMapIn + windowOffset(pStream, pStream->storage, i);
+      pWindow->buffers.pOutput = pStream->pMapOut + windowOffset(pStream, pStream->outputStorage, i);
+   }
+   else {
+      pWindow->buffers.pInput = pStream->aIn[i & 1];
+      pWindow->buffers.pOutput = pStream->aOut[i & 1];
+   }
+
+   return true;
+}
+
+int64_t closeStream(Stream *pStream){
+   waitIo(pStream);
+
+   if (NULL != pStream->pMapIn && MAP_FAILED != pStream->pMapIn) {
+      munmap(pStream->pMapIn, storageBytes(pStream->storage, pStream->cItems));
+   }
+   if (NULL != pStream->pMapOut && MAP_FAILED != pStream->pMapOut) {
+      munmap(pStream->pMapOut, storageBytes(pStream->outputStorage, pStream->cItems));
+   }
+   pStream->pMapIn = NULL;
+   pStream->pMapOut = NULL;
+
+   for (int b = 0; b < 2; ++b) {
+      if (pStream->aOut[b] != pStream->aIn[b]) {
+         free(pStream->aOut[b]);
+      }
+      free(pStream->aIn[b]);
+      pStream->aIn[b] = NULL;
+      pStream->aOut[b] = NULL;
+   }
+
+   if (pStream->fdIn >= 0) {
+      close(pStream->fdIn);
+   }
+   if (pStream->fdOut >= 0) {
+      close(pStream->fdOut);
+   }
+   pStream->fdIn = -1;
+   pStream->fdOut = -1;
+
+   return pStream->iret;
+}
+
+int64_t writeInputFile(const char *pszPath, STORAGE storage, int64_t cItems, int64_t (*pfnValue)(const void *pContext, int64_t index), const void *pContext){
+   int64_t iret = 0;
+   int64_t cWindow = roundWindow(DEFAULT_WINDOW);
+   void *pv = calloc(storageBytes(storage, cWindow), 1);
+
+   int fd = open(pszPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0) {
+      printf("Can't create input file %s\n", pszPath);
+      iret = 1;
+   }
+
+   if (NULL == pv) {
+      printf("Out of memory in writeInputFile\n");
+      iret = 1;
+   }
+
+   for (int64_t lo = 0; 0 == iret && lo < cItems; lo += cWindow) {
+      int64_t n = cItems - lo < cWindow ? cItems - lo : cWindow;
+      memset(pv, 0, storageBytes(storage, cWindow));
+      for (int64_t i = 0; i < n; ++i) {
+         storeItem(storage, pv, i, pfnValue(pContext, lo + i));
+      }
+      if (!writeFully(fd, pv, storageBytes(storage, n), storageBytes(storage, lo))) {
+         printf("Failed to write input file %s\n", pszPath);
+         iret = 1;
+      }
+   }
+
+   if (fd >= 0) {
+      close(fd);
+   }
+   free(pv);
+
+   return iret;
+}
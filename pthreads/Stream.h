@@ -0,0 +1,88 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// Include Kernels.h first: windows are handed out as KernelBuffers
+
+// Items per window when --window isn't given
+#define DEFAULT_WINDOW (1024 * 1024)
+
+// Where the items live
+typedef enum IO_MODE {
+   IO_MEMORY,        // one array allocated up front (no files)
+   IO_MMAP,          // map the files, prefetch the next window with madvise
+   IO_PREAD,         // two window buffers, filled / drained with pread & pwrite
+   IO_COUNT
+} IO_MODE;
+
+// One window of the stream, ready for the kernels
+typedef struct StreamWindow {
+
+   // first item of the window in the file, and # items in it
+   int64_t lo;
+   int64_t cItems;
+
+   // the window's items; item 0 is item lo of the file
+   KernelBuffers buffers;
+
+} StreamWindow;
+
+// An input file streamed through a bounded amount of memory, window by
+// window, with the results written to an output file.
+typedef struct Stream {
+
+   IO_MODE io;
+   STORAGE storage;           // how the input file stores the items
+   STORAGE outputStorage;     // how the output file stores the results
+   int64_t cItems;
+   int64_t cWindow;           // items per window (all but the last)
+   int64_t cWindows;
+   int64_t iWindow;           // the window nextWindow hands out next
+
+   int fdIn;
+   int fdOut;
+
+   // IO_MMAP: both files, mapped whole
+   uint8_t *pMapIn;
+   uint8_t *pMapOut;
+
+   // IO_PREAD: the window being computed on and the one being read / written;
+   // aOut == aIn when the results fit in place
+   void *aIn[2];
+   void *aOut[2];
+
+   // IO_PREAD: the background transfer, writing window iWrite then reading
+   // window iRead (either -1 for none)
+   pthread_t ioThread;
+   bool fIoThread;
+   int64_t iWrite;
+   int64_t iRead;
+
+   // first error, 0 if none
+   int64_t iret;
+
+} Stream;
+
+const char *ioModeName(IO_MODE io);
+
+// Look up by name; return IO_COUNT when unknown
+IO_MODE parseIoMode(const char *psz);
+
+// Round a window size so every window starts on a page in both files
+int64_t roundWindow(int64_t cWindow);
+
+// Open pszInput, which must hold at least cItems items, create pszOutput
+// and start fetching the first window.  Returns 0 on success.
+int64_t openStream(IO_MODE io, const char *pszInput, const char *pszOutput, STORAGE storage, STORAGE outputStorage, int64_t cItems, int64_t cWindow, Stream *pStream);
+
+// Hand out the next window.  The results of the window handed out before
+// it are written back, and the one after it is fetched, while the caller
+// works on it.  Returns false when done or on error (see closeStream).
+bool nextWindow(Stream *pStream, StreamWindow *pWindow);
+
+// Finish any I/O still in flight and close the files.  Returns the first
+// error the stream ran into, 0 if none.
+int64_t closeStream(Stream *pStream);
+
+// Write cItems items, item i being pfnValue(pContext, i), to pszPath
+int64_t writeInputFile(const char *pszPath, STORAGE storage, int64_t cItems, int64_t (*pfnValue)(const void *pContext, int64_t index), const void *pContext);
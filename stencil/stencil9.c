@@ -1,13 +1,22 @@
+#include <float.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
+#include <string.h>
+#include "ActiveTiles.h"
+#include "Grid.h"
+#include "Multigrid.h"
+#include "ParallelFor.h"
+#include "Stencil.h"
+#include "Timer.h"
 
 //
-// The logical problem size -- N x N elements
+// The logical problem size -- rows x cols elements, 1000 x 1000 unless
+// --size or --rows / --cols say otherwise
 //
-#define N 1000
-//#define N 1000
+#define DEFAULT_N 1000
 
 //
 // We'll terminate when the difference between all elements in
@@ -18,14 +27,21 @@
 //const double epsilon=1.0E-12;
 
 //
-// a utility routine for printing the inner N x N elements of
-// a physical N+2 x N+2 array
+// --precision fp32-refine stops the fp32 sweeps here, a few fp32 ulps of
+// the +/-1.0 seeds, and sweeps on in fp64 down to epsilon: below it more
+// and more of what an fp32 sweep changes is its own rounding.
 //
-void printArr(double A[N+2][N+2]) {
-  int i, j;
+#define epsilonF (16 * FLT_EPSILON)
+
+//
+// a utility routine for printing the inner rows x cols elements of
+// a physical rows+2 x cols+2 array
+//
+void printArr(double **A, int64_t rows, int64_t cols) {
+  int64_t i, j;
   
-  for (i=1; i<=N; i++) {
-    for (j=1; j<=N; j++) {
+  for (i=1; i<=rows; i++) {
+    for (j=1; j<=cols; j++) {
       printf("%5lf ", A[i][j]);
     }
     printf("\n");
@@ -35,19 +51,19 @@ void printArr(double A[N+2][N+2]) {
 
 
 //
-// This routine nitializes a logical N x N array stored as an 
-// N+2 x N+2 array by storing +1.0 in the middle-ish of its 
+// This routine nitializes a logical rows x cols array stored as an 
+// rows+2 x cols+2 array by storing +1.0 in the middle-ish of its 
 // upper-left and lower-right quadrants; and -1.0 in the middle-ish 
 // of the other two quadrants.
 //
-void initArr(double A[N+2][N+2]) {
-  int i, j;
+void initArr(double **A, int64_t rows, int64_t cols) {
+  int64_t i, j;
 
   //
   // Initialize the complete arrays to 0
   //
-  for (i=0; i<N+2; i++) {
-    for (j=0; j<N+2; j++) {
+  for (i=0; i<rows+2; i++) {
+    for (j=0; j<cols+2; j++) {
       A[i][j] = 0.0;
     }
   }
@@ -55,106 +71,710 @@ void initArr(double A[N+2][N+2]) {
   //
   // Place a nonzero entry in the center of each quadrant.
   //
-  A[N/4+1][N/4+1] = 1.0;
-  A[3*N/4+1][3*N/4+1] = 1.0;
-  A[N/4+1][3*N/4+1] = -1.0;
-  A[3*N/4+1][N/4+1] = -1.0;
+  A[rows/4+1][cols/4+1] = 1.0;
+  A[3*rows/4+1][3*cols/4+1] = 1.0;
+  A[rows/4+1][3*cols/4+1] = -1.0;
+  A[3*rows/4+1][cols/4+1] = -1.0;
 }
 
-// timing code copied from 
-// http://www.guyrutenberg.com/2007/09/22/profiling-code-using-clock_gettime/
-
-struct timespec diff(struct timespec start, struct timespec end)
-{
-	struct timespec temp;
-	if ((end.tv_nsec-start.tv_nsec)<0) {
-		temp.tv_sec = end.tv_sec-start.tv_sec-1;
-		temp.tv_nsec = 1000000000+end.tv_nsec-start.tv_nsec;
-	} else {
-		temp.tv_sec = end.tv_sec-start.tv_sec;
-		temp.tv_nsec = end.tv_nsec-start.tv_nsec;
-	}
-	return temp;
-}
+//
+// These are our two main work arrays -- we allocate them as rows+2 x
+// cols+2 even though our computation is on a logical rows x cols array in
+// order to support boundary conditions and not have to worry about
+// falling off the edges of the arrays (see Grid.h)
+//
+Grid X;
+Grid Y;
 
+// --precision fp32 / fp32-refine: the fp32 grids, and the fp64 solution
+// the result is checked against
+Grid XF;
+Grid YF;
+Grid R;
 
 //
-// These are our two main work arrays -- we declare them to be N+2 x N+2
-// even though our computation is on a logical N x N array in order to
-// support boundary conditions and not have to worry about falling off
-// the edges of the arrays
+// One sweep reads src and writes dst; the two swap roles every iteration
+// instead of copying dst back into src.
+//
+// With temporal blocking (cDepth > 1) one pass advances cDepth steps at
+// once, tile by tile: a tile is a band of cTileRows rows, and each worker
+// carries its tile through the intermediate steps in its own scratch rows
+// while they are in cache, writing only the last step to dst.  The tile
+// recomputes the cDepth-1 rows around it it needs from its neighbours
+// (the band shrinks by a row per step), so tiles never wait on each other.
 //
-double X[N+2][N+2];
-double Y[N+2][N+2];
+typedef struct Sweep {
+   double **src;              // rows of the grids, see Grid.h
+   double **dst;
+   int64_t cRows;
+   int64_t cCols;
+   int64_t stride;
+   PFN_STENCIL9_ROW pfnRow;   // see Stencil.h
 
-int main() {
-  int i, j;
-  struct timespec tStart;
-  struct timespec tEnd;
+   // temporal blocking
+   int64_t cTileRows;
+   int64_t cDepth;
+   int64_t cScratchRows;      // cTileRows + 2 (cDepth-1), per step buffer
+   double **aScratch;         // per worker: two step buffers of cScratchRows rows
 
-  initArr(X);
-  //printArr(X);
-  
-  double delta = 0.0;
-  int numIters = 0;
+   // active-tile tracking (NULL when off)
+   ActiveTiles *pTiles;
 
-  clock_gettime(CLOCK_REALTIME, &tStart);
+   // in-place colour sweeps: the colour being updated (see Stencil.h)
+   int64_t firstRow;
+   int64_t firstCol;
 
-  do {
-    numIters += 1;
+   // fp32 sweeps (srcF NULL when sweeping fp64), and the fp64 reference
+   float **srcF;
+   float **dstF;
+   PFN_STENCIL9_ROW_F pfnRowF;
+   double **ref;
+} Sweep;
 
-    //
-    // TODO: implement the stencil computation here
-    //
+// rows [lo, hi) of one sweep, returning the largest change
+static inline double sweepRows(Sweep *pSweep, int64_t lo, int64_t hi) {
+   int64_t i;
+   double delta = 0.0;
+   for (i=lo; i < hi; ++i) {
+      double temp = pSweep->pfnRow(pSweep->src[i-1], pSweep->src[i], pSweep->src[i+1], pSweep->dst[i], pSweep->cCols);
+      if (delta < temp) delta = temp;
+   }
+   return delta;
+}
+
+DEFINE_PARALLEL_REDUCE(parallelSweep, Sweep, 0.0, sweepRows, parallelMax)
 
-   #pragma omp parallel for default(none) private(i,j) shared(X,Y)
-   for (i=1; i <= N; ++i) {
-      for (j=1; j <= N; ++j) {
-         double center = X[i][j] * 0.25;
-         double adjacent = (X[i-1][j] + X[i+1][j] + X[i][j-1] + X[i][j+1]) * 0.125;
-         double diagonals = (X[i-1][j-1] + X[i+1][j-1] + X[i-1][j+1] + X[i+1][j+1]) * 0.0625;
+// rows [lo, hi) of one fp32 sweep; the change comes back as a double
+static inline double sweepRowsF(Sweep *pSweep, int64_t lo, int64_t hi) {
+   double delta = 0.0;
+   for (int64_t i = lo; i < hi; ++i) {
+      double temp = pSweep->pfnRowF(pSweep->srcF[i-1], pSweep->srcF[i], pSweep->srcF[i+1], pSweep->dstF[i], pSweep->cCols);
+      if (delta < temp) delta = temp;
+   }
+   return delta;
+}
+
+DEFINE_PARALLEL_REDUCE(parallelSweepF, Sweep, 0.0, sweepRowsF, parallelMax)
 
-         Y[i][j] = 
-            (center + adjacent + diagonals);
+// rows [lo, hi) of src, halo and all, rounded into srcF
+static inline void toFloatRows(Sweep *pSweep, int64_t lo, int64_t hi) {
+   for (int64_t i = lo; i < hi; ++i) {
+      for (int64_t j = 0; j < pSweep->cCols+2; ++j) {
+         pSweep->srcF[i][j] = (float)pSweep->src[i][j];
       }
    }
+}
 
-    // TODO: implement the computation of delta and get ready for the
-    // next iteration here...
-    //
-    // 1) check for termination here by computing delta -- the largest
-    //    absolute difference between corresponding elements of X and Y
-    //    (i.e., the biggest change due to the application of the stencil 
-    //    for this iteration of the while loop)
-    //
-    // 2) copy Y back to X to set up for the next execution
-    //
+DEFINE_PARALLEL_FOR(parallelToFloat, Sweep, toFloatRows)
+
+// rows [lo, hi) of srcF widened into src
+static inline void toDoubleRows(Sweep *pSweep, int64_t lo, int64_t hi) {
+   for (int64_t i = lo; i < hi; ++i) {
+      for (int64_t j = 0; j < pSweep->cCols+2; ++j) {
+         pSweep->src[i][j] = pSweep->srcF[i][j];
+      }
+   }
+}
+
+DEFINE_PARALLEL_FOR(parallelToDouble, Sweep, toDoubleRows)
 
-   //Compute Delta
-   delta = 0.0;
-   #pragma omp parallel for default(none) private(j) shared(X,Y) reduction(max:delta)
-   for (i=1; i <= N; ++i) {
-      for (j=1; j <= N; ++j) {
-         double temp = fabs(Y[i][j] - X[i][j]);
-         if (delta < temp) delta = temp;
+// rows [lo, hi): the largest difference between the result (srcF if set,
+// else src) and ref
+static inline double errorRows(Sweep *pSweep, int64_t lo, int64_t hi) {
+   double error = 0.0;
+   for (int64_t i = lo; i < hi; ++i) {
+      for (int64_t j = 1; j <= pSweep->cCols; ++j) {
+         double value = NULL != pSweep->srcF ? pSweep->srcF[i][j] : pSweep->src[i][j];
+         double temp = fabs(value - pSweep->ref[i][j]);
+         if (error < temp) error = temp;
       }
    }
+   return error;
+}
+
+DEFINE_PARALLEL_REDUCE(parallelError, Sweep, 0.0, errorRows, parallelMax)
+
+// rows [lo, hi) of src copied into ref
+static inline void copyRefRows(Sweep *pSweep, int64_t lo, int64_t hi) {
+   for (int64_t i = lo; i < hi; ++i) {
+      memcpy(pSweep->ref[i], pSweep->src[i], (pSweep->cCols+2) * sizeof(double));
+   }
+}
+
+DEFINE_PARALLEL_FOR(parallelCopyRef, Sweep, copyRefRows)
+
+// Run by each pool thread once, not per range
+static void *flushDenormalsWorker(void *ptr) {
+   (void)ptr;
+   stencilFlushDenormals();
+   return NULL;
+}
+
+static void *restoreDenormalsWorker(void *ptr) {
+   (void)ptr;
+   stencilRestoreDenormals();
+   return NULL;
+}
+
+// Row r after step `step` of the pass, for the tile whose rows start at lo:
+// src for step 0 and for the fixed zero boundary, scratch otherwise
+static inline double *tileRow(Sweep *pSweep, double *pScratch, int64_t lo, int64_t step, int64_t r) {
+   if (step == 0 || r == 0 || r == pSweep->cRows+1) {
+      return pSweep->src[r];
+   }
+   int64_t k = r - (lo - (pSweep->cDepth - 1));
+   return pScratch + (((step - 1) & 1) * pSweep->cScratchRows + k) * pSweep->stride;
+}
+
+// tiles [lo, hi) of one pass, returning the largest change of its last step
+static inline double sweepTiles(Sweep *pSweep, int64_t lo, int64_t hi) {
+   double *pScratch = pSweep->aScratch[currentParallelTask()];
+   int64_t T = pSweep->cDepth;
+   int64_t end = pSweep->cRows + 1;
+   double delta = 0.0;
+
+   for (int64_t t = lo; t < hi; ++t) {
+      int64_t rowLo = 1 + t * pSweep->cTileRows;
+      int64_t rowHi = rowLo + pSweep->cTileRows < end ? rowLo + pSweep->cTileRows : end;
+
+      for (int64_t s = 1; s <= T; ++s) {
+         // step s is needed T-s rows beyond the tile on either side
+         int64_t rLo = rowLo - (T - s) > 1 ? rowLo - (T - s) : 1;
+         int64_t rHi = rowHi + (T - s) < end ? rowHi + (T - s) : end;
+
+         for (int64_t r = rLo; r < rHi; ++r) {
+            double *out = s == T ? pSweep->dst[r] : tileRow(pSweep, pScratch, rowLo, s, r);
+            double temp = pSweep->pfnRow(tileRow(pSweep, pScratch, rowLo, s-1, r-1),
+                                         tileRow(pSweep, pScratch, rowLo, s-1, r),
+                                         tileRow(pSweep, pScratch, rowLo, s-1, r+1), out, pSweep->cCols);
+            if (s == T && delta < temp) delta = temp;
+         }
+      }
+   }
+   return delta;
+}
+
+DEFINE_PARALLEL_REDUCE(parallelTiles, Sweep, 0.0, sweepTiles, parallelMax)
+
+// entries [lo, hi) of the active tile list, returning the largest change
+static inline double sweepActiveTiles(Sweep *pSweep, int64_t lo, int64_t hi) {
+   double delta = 0.0;
+   for (int64_t k = lo; k < hi; ++k) {
+      double temp = runActiveTile(pSweep->pTiles, k, pSweep->pfnRow, pSweep->src, pSweep->dst);
+      if (delta < temp) delta = temp;
+   }
+   return delta;
+}
+
+DEFINE_PARALLEL_REDUCE(parallelActiveTiles, Sweep, 0.0, sweepActiveTiles, parallelMax)
+
+// rows firstRow + 2 [lo, hi) of one colour, updated in place in src
+static inline double colourRows(Sweep *pSweep, int64_t lo, int64_t hi) {
+   double delta = 0.0;
+   for (int64_t k = lo; k < hi; ++k) {
+      int64_t i = pSweep->firstRow + 2 * k;
+      double temp = stencil9RowColour(pSweep->src[i-1], pSweep->src[i], pSweep->src[i+1], pSweep->cCols, pSweep->firstCol);
+      if (delta < temp) delta = temp;
+   }
+   return delta;
+}
+
+DEFINE_PARALLEL_REDUCE(parallelColour, Sweep, 0.0, colourRows, parallelMax)
+
+// One in-place sweep, colour by colour, returning the largest change
+static double colourSweep(ParallelPool *pPool, Sweep *pSweep) {
+   double delta = 0.0;
+   for (int64_t c = 0; c < STENCIL_COLOURS; ++c) {
+      pSweep->firstRow = stencilColourFirst(c / 2, 0);
+      pSweep->firstCol = stencilColourFirst(c % 2, 0);
+      double temp = parallelColour(pPool, 0, (pSweep->cRows - pSweep->firstRow + 2) / 2, pSweep);
+      if (delta < temp) delta = temp;
+   }
+   return delta;
+}
+
+// Size the workers' scratch for cTileRows x cDepth tiles.  Returns 0 on success.
+static int64_t setTiling(Sweep *pSweep, int64_t cThreads, int64_t cTileRows, int64_t cDepth) {
+   int64_t iret = 0;
+
+   pSweep->cTileRows = cTileRows;
+   pSweep->cDepth = cDepth;
+   pSweep->cScratchRows = cTileRows + 2 * (cDepth - 1);
+
+   for (int64_t t = 0; t < cThreads; ++t) {
+      free(pSweep->aScratch[t]);
+      pSweep->aScratch[t] = NULL;
+      // calloc: the halo columns are never written and must stay zero
+      if (cDepth > 1 && NULL == (pSweep->aScratch[t] = calloc(2 * pSweep->cScratchRows * pSweep->stride, sizeof(double)))) {
+         printf("Out of memory allocating the tile scratch!\n");
+         iret = 1; // out of memory
+      }
+   }
+
+   return iret;
+}
+
+// Advance cDepth steps, leaving the result in src, and return the largest
+// change of the last one
+static double advance(ParallelPool *pPool, Sweep *pSweep) {
+   double delta;
+
+   if (NULL != pSweep->srcF) {
+      delta = parallelSweepF(pPool, 1, pSweep->cRows+1, pSweep);
+
+      float **tempF = pSweep->srcF;
+      pSweep->srcF = pSweep->dstF;
+      pSweep->dstF = tempF;
+      return delta;
+   }
+
+   if (NULL != pSweep->pTiles) {
+      planActiveTiles(pSweep->pTiles);
+      delta = parallelActiveTiles(pPool, 0, pSweep->pTiles->cList, pSweep);
+   }
+   else if (pSweep->cDepth == 1) {
+      delta = parallelSweep(pPool, 1, pSweep->cRows+1, pSweep);
+   }
+   else {
+      delta = parallelTiles(pPool, 0, (pSweep->cRows + pSweep->cTileRows - 1) / pSweep->cTileRows, pSweep);
+   }
+
+   double **temp = pSweep->src;
+   pSweep->src = pSweep->dst;
+   pSweep->dst = temp;
+
+   return delta;
+}
+
+// Plain sweeps until a sweep changes nothing by more than tolerance;
+// returns the number of them
+static int iterate(ParallelPool *pPool, Sweep *pSweep, double tolerance) {
+   int numIters = 0;
+   double delta;
+   do {
+      numIters += pSweep->cDepth;
+      delta = advance(pPool, pSweep);
+   } while (delta > tolerance);
+   return numIters;
+}
+
+// --tune: time a fixed number of steps from the initial grid for each
+// tile size and depth, and return the fastest in *pcTileRows, *pcDepth
+#define TUNE_STEPS 48
+
+static int64_t tune(ParallelPool *pPool, Sweep *pSweep, int64_t cThreads, int64_t *pcTileRows, int64_t *pcDepth) {
+   static const int64_t aTileRows[] = { 8, 16, 32, 64, 128 };
+   static const int64_t aDepths[] = { 1, 2, 3, 4, 6, 8 };
+   const int64_t cTileRowsTried = sizeof(aTileRows) / sizeof(aTileRows[0]);
+   const int64_t cDepthsTried = sizeof(aDepths) / sizeof(aDepths[0]);
+   double best = -1.0;
+
+   printf("tile, depth, us/step\n");
+   for (int64_t d = 0; d < cDepthsTried; ++d) {
+      for (int64_t r = 0; r < cTileRowsTried; ++r) {
+         if (0 != setTiling(pSweep, cThreads, aTileRows[r], aDepths[d])) {
+            return 1;
+         }
+
+         initArr(pSweep->src, pSweep->cRows, pSweep->cCols);
+         int64_t tStart = nowNs();
+         for (int64_t step = 0; step < TUNE_STEPS; step += aDepths[d]) {
+            advance(pPool, pSweep);
+         }
+         double usPerStep = (nowNs() - tStart) / 1e3 / TUNE_STEPS;
+         printf("%lld, %lld, %.3f\n", (long long)aTileRows[r], (long long)aDepths[d], usPerStep);
+
+         if (best < 0 || usPerStep < best) {
+            best = usPerStep;
+            *pcTileRows = aTileRows[r];
+            *pcDepth = aDepths[d];
+         }
+
+         // the depth doesn't use the tile size
+         if (aDepths[d] == 1) {
+            break;
+         }
+      }
+   }
+
+   return 0;
+}
+
+// Point a sweep at a new pair of cRows x cCols grids, cleared on the
+// pool's threads, with src seeded by initArr.  fInPlace: just the one grid
+// (dst is NULL).  Returns 0 on success.
+static int64_t setGrids(ParallelPool *pPool, Sweep *pSweep, int64_t cRows, int64_t cCols, bool fHugePages, bool fInPlace) {
+   destroyGrid(&X);
+   destroyGrid(&Y);
+   if (0 != createGrid(cRows, cCols, fHugePages, &X) || (!fInPlace && 0 != createGrid(cRows, cCols, fHugePages, &Y))) {
+      return 1;
+   }
+
+   parallelClear(pPool, 0, cRows+2, &X);
+   if (!fInPlace) {
+      parallelClear(pPool, 0, cRows+2, &Y);
+   }
+
+   pSweep->src = X.aRows;
+   pSweep->dst = Y.aRows;
+   pSweep->cRows = cRows;
+   pSweep->cCols = cCols;
+   pSweep->stride = X.stride;
+
+   initArr(X.aRows, cRows, cCols);
+   return 0;
+}
 
-   #pragma omp parallel for default(none) private(j) shared(X,Y)
-   // copy Y back to X to setup for next iteration
-   for (i=1; i <=N; ++i) {
-      for (j=1; j <=N; ++j) {
-         X[i][j] = Y[i][j];
+// --size-sweep: time SIZE_SWEEP_POINTS points' worth of steps on square
+// grids from 64 x 64 up to cMax x cMax -- 64, 96, 128, 192, 256, ..., so
+// steps of 1.5x and 4/3x in turn -- to see the grids fall out of L2, then
+// L3, into DRAM
+#define SIZE_SWEEP_POINTS 200000000LL
+
+static int64_t sizeSweep(ParallelPool *pPool, Sweep *pSweep, int64_t cThreads, int64_t cMax, bool fHugePages) {
+   int64_t cTileRows = pSweep->cTileRows;
+   int64_t cDepth = pSweep->cDepth;
+
+   printf("n, mb, steps, ns/point\n");
+   for (int64_t base = 64; base <= cMax; base *= 2) {
+      for (int64_t n = base; n <= cMax && n < 2 * base; n += base / 2) {
+         if (0 != setGrids(pPool, pSweep, n, n, fHugePages, false) || 0 != setTiling(pSweep, cThreads, cTileRows, cDepth)) {
+            return 1;
+         }
+
+         int64_t cSteps = SIZE_SWEEP_POINTS / (n * n);
+         cSteps = cSteps < 2 * cDepth ? 2 * cDepth : cSteps / cDepth * cDepth;
+
+         int64_t tStart = nowNs();
+         for (int64_t step = 0; step < cSteps; step += cDepth) {
+            advance(pPool, pSweep);
+         }
+         double ns = (double)(nowNs() - tStart);
+
+         printf("%lld, %.1f, %lld, %.3f\n", (long long)n, 2.0 * X.cb / (1024 * 1024),
+                (long long)cSteps, ns / ((double)cSteps * n * n));
       }
    }
 
+   return 0;
+}
+
+int main(int argc, char *argv[]) {
+  struct timespec tStart;
+  struct timespec tEnd;
+  ParallelPool pool;
+
+  //
+  // stencil9 [--threads T] [--kernel auto|scalar|avx2|avx512]
+  //          [--tile ROWS] [--depth STEPS] [--tune]
+  //          [--active off|exact|epsilon] [--tile-cols COLS]
+  //          [--size N | --rows R --cols C] [--huge] [--size-sweep MAX]
+  //          [--multigrid off|v|w] [--smooth SWEEPS] [--update jacobi|colour]
+  //          [--precision fp64|fp32|fp32-refine]
+  // One thread per online cpu by default, like the OpenMP version this
+  // replaced, and the widest row kernel the cpu runs.  --depth > 1 turns
+  // on temporal blocking in tiles of --tile rows, and convergence is then
+  // checked once per --depth steps; --tune picks both by timing a sweep
+  // of them first.  --active only sweeps the --tile x --tile-cols tiles
+  // that changed, or are next to one that did: at all ("exact", which gives
+  // the full sweep's result) or by more than epsilon.  The tiles are whole
+  // rows by default; narrow ones defeat the hardware prefetcher.  --huge
+  // asks for transparent huge pages for the grids.  --size-sweep times the
+  // chosen configuration over a range of sizes instead of solving.
+  // --multigrid solves with V- or W-cycles (see Multigrid.h) of --smooth
+  // sweeps before and after each coarse correction; an iteration is then
+  // a cycle.  --update colour updates one grid in place, four colours per
+  // sweep (Gauss-Seidel), instead of sweeping X into Y.  --precision fp32
+  // sweeps fp32 grids, halving the bytes moved, and fp32-refine stops them
+  // at the looser epsilonF and finishes with fp64 sweeps; both then also
+  // sweep in fp64, untimed, and report how far off they were after as
+  // many sweeps.
+  //
+  int64_t cThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  STENCIL_KERNEL kernel = STENCIL_AUTO;
+  int64_t cTileRows = 32;
+  int64_t cDepth = 1;
+  int64_t cRows = DEFAULT_N;
+  int64_t cCols = DEFAULT_N;
+  int64_t cTileCols = 0;
+  int64_t cSweepMax = 0;
+  bool fTune = false;
+  bool fHugePages = false;
+  const char *pszActive = "off";
+  const char *pszMultigrid = "off";
+  int64_t cSmooth = 2;
+  const char *pszUpdate = "jacobi";
+  const char *pszPrecision = "fp64";
+  int i;
+
+  for (i = 1; i < argc; i += 2) {
+    if (0 == strcmp(argv[i], "--tune")) {
+      fTune = true;
+      --i;
+    }
+    else if (0 == strcmp(argv[i], "--huge")) {
+      fHugePages = true;
+      --i;
+    }
+    else if (i + 1 == argc) {
+      break;
+    }
+    else if (0 == strcmp(argv[i], "--threads")) {
+      cThreads = atol(argv[i+1]);
+    }
+    else if (0 == strcmp(argv[i], "--kernel")) {
+      kernel = parseStencilKernel(argv[i+1]);
+    }
+    else if (0 == strcmp(argv[i], "--tile")) {
+      cTileRows = atol(argv[i+1]);
+    }
+    else if (0 == strcmp(argv[i], "--depth")) {
+      cDepth = atol(argv[i+1]);
+    }
+    else if (0 == strcmp(argv[i], "--tile-cols")) {
+      cTileCols = atol(argv[i+1]);
+    }
+    else if (0 == strcmp(argv[i], "--active")) {
+      pszActive = argv[i+1];
+    }
+    else if (0 == strcmp(argv[i], "--size")) {
+      cRows = cCols = atol(argv[i+1]);
+    }
+    else if (0 == strcmp(argv[i], "--rows")) {
+      cRows = atol(argv[i+1]);
+    }
+    else if (0 == strcmp(argv[i], "--cols")) {
+      cCols = atol(argv[i+1]);
+    }
+    else if (0 == strcmp(argv[i], "--size-sweep")) {
+      cSweepMax = atol(argv[i+1]);
+    }
+    else if (0 == strcmp(argv[i], "--multigrid")) {
+      pszMultigrid = argv[i+1];
+    }
+    else if (0 == strcmp(argv[i], "--smooth")) {
+      cSmooth = atol(argv[i+1]);
+    }
+    else if (0 == strcmp(argv[i], "--update")) {
+      pszUpdate = argv[i+1];
+    }
+    else if (0 == strcmp(argv[i], "--precision")) {
+      pszPrecision = argv[i+1];
+    }
+    else {
+      break;
+    }
+  }
+
+  bool fActive = 0 != strcmp(pszActive, "off");
+  double threshold = 0 == strcmp(pszActive, "epsilon") ? epsilon : 0.0;
+  if (0 == cTileCols) {
+    cTileCols = cCols;
+  }
+  bool fMultigrid = 0 != strcmp(pszMultigrid, "off");
+  MG_CYCLE cycle = 0 == strcmp(pszMultigrid, "w") ? MG_W : MG_V;
+  bool fColour = 0 == strcmp(pszUpdate, "colour");
+  bool fFloat = 0 != strcmp(pszPrecision, "fp64");
+  bool fRefine = 0 == strcmp(pszPrecision, "fp32-refine");
+
+  // temporal blocking has no tiles to skip
+  if (i < argc || cThreads < 1 || kernel == STENCIL_COUNT || cTileRows < 1 || cTileCols < 1 || cDepth < 1 ||
+      cRows < 1 || cCols < 1 || cSweepMax < 0 ||
+      (fActive && 0 != strcmp(pszActive, "exact") && 0 != strcmp(pszActive, "epsilon")) ||
+      (fActive && (cDepth > 1 || fTune || cSweepMax > 0)) || cSmooth < 1 ||
+      (fMultigrid && 0 != strcmp(pszMultigrid, "v") && 0 != strcmp(pszMultigrid, "w")) ||
+      (fMultigrid && (fActive || cDepth > 1 || fTune || cSweepMax > 0)) ||
+      (!fColour && 0 != strcmp(pszUpdate, "jacobi")) ||
+      (fColour && (fActive || fMultigrid || cDepth > 1 || fTune || cSweepMax > 0)) ||
+      (fFloat && !fRefine && 0 != strcmp(pszPrecision, "fp32")) ||
+      (fFloat && (fActive || fMultigrid || fColour || cDepth > 1 || fTune || cSweepMax > 0))) {
+    printf("Usage: stencil9 [--threads T] [--kernel auto|scalar|avx2|avx512]\n"
+           "                [--tile ROWS] [--depth STEPS] [--tune]\n"
+           "                [--active off|exact|epsilon] [--tile-cols COLS]\n"
+           "                [--size N | --rows R --cols C] [--huge] [--size-sweep MAX]\n"
+           "                [--multigrid off|v|w] [--smooth SWEEPS] [--update jacobi|colour]\n"
+           "                [--precision fp64|fp32|fp32-refine]\n"
+           "--active, --multigrid, --update colour and fp32 need --depth 1 and no\n"
+           "--tune or --size-sweep, and don't go together\n");
+    return 1;
+  }
+
+  PFN_STENCIL9_ROW pfnRow = selectStencil9Row(&kernel);
+  if (NULL == pfnRow) {
+    return 1;
+  }
+
+  if (0 != createParallelPool(cThreads, &pool)) {
+    return 1;
+  }
+
+  Sweep sweep = {
+    .cRows = cRows,
+    .cCols = cCols,
+    .pfnRow = pfnRow,
+    .cTileRows = cTileRows,
+    .cDepth = cDepth,
+  };
+
+  sweep.aScratch = calloc(cThreads, sizeof(double*));
+  if (NULL == sweep.aScratch) {
+    printf("Out of memory allocating the tile scratch!\n");
+    return 1;
+  }
+
+  if (cSweepMax > 0) {
+    int64_t iret = sizeSweep(&pool, &sweep, cThreads, cSweepMax, fHugePages);
+    destroyParallelPool(&pool);
+    setTiling(&sweep, cThreads, cTileRows, 1);
+    free(sweep.aScratch);
+    destroyGrid(&X);
+    destroyGrid(&Y);
+    return (int)iret;
+  }
+
+  // the boundary stays zero from the first touch, in both grids
+  if (0 != setGrids(&pool, &sweep, cRows, cCols, fHugePages, fColour)) {
+    return 1;
+  }
+
+  if (fTune) {
+    if (0 != tune(&pool, &sweep, cThreads, &cTileRows, &cDepth)) {
+      return 1;
+    }
+    printf("Using --tile %lld --depth %lld\n", (long long)cTileRows, (long long)cDepth);
+    sweep.src = X.aRows;
+    sweep.dst = Y.aRows;
+  }
+
+  if (0 != setTiling(&sweep, cThreads, cTileRows, cDepth)) {
+    return 1;
+  }
+
+  ActiveTiles tiles;
+  if (fActive) {
+    if (0 != createActiveTiles(cRows, cCols, cTileRows, cTileCols, threshold, &tiles)) {
+      return 1;
+    }
+    sweep.pTiles = &tiles;
+  }
+
+  initArr(X.aRows, cRows, cCols);
+  //printArr(X.aRows, cRows, cCols);
+
+  // the fp32 grids, and one for the fp32 result to check against fp64
+  if (fFloat) {
+    if (0 != createGrid(cRows, cCols, fHugePages, &R) ||
+        0 != createGridF(cRows, cCols, fHugePages, &XF) || 0 != createGridF(cRows, cCols, fHugePages, &YF)) {
+      return 1;
+    }
+    parallelClear(&pool, 0, cRows+2, &R);
+    parallelClear(&pool, 0, cRows+2, &XF);
+    parallelClear(&pool, 0, cRows+2, &YF);
+    sweep.pfnRowF = selectStencil9RowF(kernel);
+  }
+
+  Multigrid mg;
+  if (fMultigrid) {
+    if (0 != createMultigrid(&pool, pfnRow, cRows, cCols, X.aRows, Y.aRows, cSmooth, cycle, fHugePages, &mg)) {
+      return 1;
+    }
+  }
+
+  double delta = 0.0;
+  int numIters = 0;
+  int floatIters = 0;
+
+  tStart = now();
+
+  if (fFloat) {
+    // fp32 sweeps from the rounded initial grid, then (fp32-refine) fp64
+    // ones from the widened result, back in IEEE mode
+    runThreadPool(&pool.pool, flushDenormalsWorker, pool.aWorkers, sizeof(ParallelWorker));
+    sweep.srcF = XF.aRowsF;
+    sweep.dstF = YF.aRowsF;
+    parallelToFloat(&pool, 0, cRows+2, &sweep);
+    floatIters = iterate(&pool, &sweep, fRefine ? epsilonF : epsilon);
+    runThreadPool(&pool.pool, restoreDenormalsWorker, pool.aWorkers, sizeof(ParallelWorker));
+
+    parallelToDouble(&pool, 0, cRows+2, &sweep);
+    sweep.srcF = NULL;
+    if (fRefine) {
+      numIters = iterate(&pool, &sweep, epsilon);
+    }
+  }
+  else do {
+    if (fMultigrid) {
+      // one cycle; delta is what the next plain sweep would change
+      numIters += 1;
+      delta = multigridCycle(&mg);
+      continue;
+    }
+
+    if (fColour) {
+      numIters += 1;
+      delta = colourSweep(&pool, &sweep);
+      continue;
+    }
+
+    numIters += cDepth;
+
+    //
+    // Apply the stencil and compute delta -- the largest absolute
+    // difference between corresponding elements of X and Y -- in the same
+    // sweep, then swap X and Y to set up for the next iteration.  With
+    // temporal blocking that's cDepth steps, and delta is the last one's.
+    //
+    delta = advance(&pool, &sweep);
+
   } while (delta > epsilon);
 
-  clock_gettime(CLOCK_REALTIME, &tEnd);
+  tEnd = now();
+
+  // Untimed, the fp64 solution from the same start: the error is against
+  // it after as many sweeps as the fp32 run took, and it goes on until it
+  // converges to count how many fp64 alone needs
+  double error = 0.0;
+  int refIters = 0;
+  if (fFloat) {
+    sweep.ref = R.aRows;
+    parallelCopyRef(&pool, 0, cRows+2, &sweep);
+    initArr(sweep.src, cRows, cCols);
+    for (int k = 1; k <= floatIters + numIters || 0 == refIters; ++k) {
+      delta = advance(&pool, &sweep);
+      if (k == floatIters + numIters) {
+        error = parallelError(&pool, 1, cRows+1, &sweep);
+      }
+      if (delta <= epsilon && 0 == refIters) {
+        refIters = k;
+      }
+    }
+  }
+
+  destroyParallelPool(&pool);
+  setTiling(&sweep, cThreads, cTileRows, 1);
+  free(sweep.aScratch);
   
-  //printArr(X);
+  // the last sweep's result is in sweep.src (mg.aLevels[0].e for multigrid)
+  //printArr(sweep.src, cRows, cCols);
 
-  printf("Took %d iterations to converge\n", numIters);
+  printf("Took %d iterations to converge\n", floatIters + numIters);
+  if (fFloat) {
+    printf("%d fp32 + %d fp64 iterations, max error %.3g against as many fp64 iterations (fp64 alone converges in %d)\n",
+           floatIters, numIters, error, refIters);
+    destroyGrid(&XF);
+    destroyGrid(&YF);
+    destroyGrid(&R);
+  }
+  if (fActive) {
+    printf("Swept %.1f%% of the tiles\n", 100.0 * tiles.cSwept / ((double)numIters * tiles.cTilesDown * tiles.cTilesAcross));
+    destroyActiveTiles(&tiles);
+  }
+  if (fMultigrid) {
+    printf("%lld levels, %lld sweeps of the full grid\n", (long long)mg.cLevels, (long long)mg.cFineSweeps);
+    destroyMultigrid(&mg);
+  }
+  destroyGrid(&X);
+  destroyGrid(&Y);
   struct timespec tsDiff = diff(tStart, tEnd);
   //printf("Elapsed Time: %d.%09d Sec.\n", tsDiff.tv_sec, tsDiff.tv_nsec);
   printf("%d.%09d\n",tsDiff.tv_sec, tsDiff.tv_nsec);